@@ -0,0 +1,848 @@
+#include "archive.hpp"
+#include "hash.hpp"
+#include "uring.hpp"
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <filesystem>
+#include <map>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+static const size_t blockSize = 512;
+
+// files up to this size go to the worker pool, and at most this many
+// bytes of file bodies are waiting for a worker at any time
+static const uint64_t pooledFile = 1 << 20;
+static const size_t pooledBytes = 64 << 20;
+
+// pax record carrying a file's SHA-256, written by TarWriter
+static const char* paxDigest = "PACMANOC.sha256";
+
+// Numeric header fields are octal text, or base-256 when the top bit of
+// the first byte is set (GNU, for values that do not fit).
+static uint64_t number(const char* p, size_t n) {
+    if ((unsigned char)p[0] & 0x80) {
+        uint64_t v = (unsigned char)p[0] & 0x7f;
+        for (size_t i = 1; i < n; ++i) v = (v << 8) | (unsigned char)p[i];
+        return v;
+    }
+    uint64_t v = 0;
+    size_t i = 0;
+    while (i < n && (p[i] == ' ' || p[i] == '\0')) ++i;
+    for (; i < n && p[i] >= '0' && p[i] <= '7'; ++i) v = v * 8 + (p[i] - '0');
+    return v;
+}
+
+static std::string field(const char* p, size_t n) {
+    return std::string(p, strnlen(p, n));
+}
+
+static bool checksumOk(const char* h) {
+    uint64_t want = number(h + 148, 8);
+    uint64_t sum = 0;
+    for (size_t i = 0; i < blockSize; ++i)
+        sum += (i >= 148 && i < 156) ? ' ' : (unsigned char)h[i];
+    return sum == want;
+}
+
+// Archive paths are made relative: leading '/' and '.' components are
+// dropped (as tar does) and anything climbing out with ".." is refused.
+static bool cleanPath(std::string& path) {
+    std::string out;
+    size_t i = 0;
+    while (i <= path.size()) {
+        size_t j = path.find('/', i);
+        if (j == std::string::npos) j = path.size();
+        std::string part = path.substr(i, j - i);
+        if (part == "..") return false;
+        if (!part.empty() && part != ".") {
+            if (!out.empty()) out += '/';
+            out += part;
+        }
+        i = j + 1;
+    }
+    path = out;
+    return true;
+}
+
+static void parsePax(const std::string& data, Entry& e, bool& hasSize) {
+    size_t i = 0;
+    while (i < data.size()) {
+        size_t sp = data.find(' ', i);
+        if (sp == std::string::npos) break;
+        size_t len = std::strtoull(data.c_str() + i, nullptr, 10);
+        if (len == 0 || i + len > data.size()) break;
+        std::string rec = data.substr(sp + 1, i + len - sp - 2);
+        size_t eq = rec.find('=');
+        if (eq != std::string::npos) {
+            std::string key = rec.substr(0, eq), val = rec.substr(eq + 1);
+            if (key == "path") e.path = val;
+            else if (key == "linkpath") e.link = val;
+            else if (key == "size") { e.size = std::strtoull(val.c_str(), nullptr, 10); hasSize = true; }
+            else if (key == "mtime") e.mtime = std::strtoll(val.c_str(), nullptr, 10);
+            else if (key == paxDigest) e.sha256 = val;
+        }
+        i += len;
+    }
+}
+
+Extractor::Extractor(const std::string& dest, int threads) : buf(1 << 20) {
+    std::error_code ec;
+    std::filesystem::create_directories(dest, ec);
+    dirfd = ::open(dest.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0) message = "cannot open " + dest + ": " + strerror(errno);
+
+    for (int i = 0; i < threads && threads > 1; ++i)
+        workers.emplace_back(&Extractor::worker, this);
+}
+
+Extractor::~Extractor() {
+    {
+        std::lock_guard<std::mutex> lock(m);
+        stopping = true;
+    }
+    work.notify_all();
+    for (auto& t : workers) t.join();
+    if (dirfd >= 0) ::close(dirfd);
+    if (storefd >= 0) ::close(storefd);
+}
+
+bool Extractor::setStore(const std::string& dir) {
+    std::error_code ec;
+    std::string objects = dir + "/objects";
+    std::filesystem::create_directories(objects, ec);
+    int fd = ::open(objects.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat a, b;
+    if (fd < 0 || dirfd < 0 || ::fstat(fd, &a) != 0 || ::fstat(dirfd, &b) != 0 || a.st_dev != b.st_dev) {
+        if (fd >= 0) ::close(fd);
+        return false;
+    }
+    storefd = fd;
+    return true;
+}
+
+bool Extractor::setUring(unsigned depth) {
+    // up to four entries per file: unlink, open, write, close
+    std::unique_ptr<Uring> r(new Uring(depth * 4, depth));
+    if (depth == 0 || !r->ok()) return false;
+    ring = std::move(r);
+    ringDepth = depth;
+    umaskBits = ::umask(0);
+    ::umask(umaskBits);
+    return true;
+}
+
+static std::string objectPath(const std::string& hash) {
+    return hash.substr(0, 2) + "/" + hash.substr(2);
+}
+
+bool Extractor::haveObject(const std::string& hash) {
+    struct stat st;
+    return hash.size() == 64 && ::fstatat(storefd, objectPath(hash).c_str(), &st, 0) == 0;
+}
+
+int Extractor::newObject(std::string& tmp) {
+    tmp = ".tmp." + std::to_string(::getpid()) + "." + std::to_string(tmpCount++);
+    int fd = ::openat(storefd, tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    return fd < 0 ? -errno : fd;
+}
+
+// Moves a finished (and closed) object into place, or drops it on err.
+int Extractor::publish(const std::string& tmp, const std::string& hash, int err) {
+    if (!err) {
+        ::mkdirat(storefd, hash.substr(0, 2).c_str(), 0755);
+        // a concurrent duplicate is replaced by identical content
+        if (::renameat(storefd, tmp.c_str(), storefd, objectPath(hash).c_str()) == 0) return 0;
+        err = errno;
+    }
+    ::unlinkat(storefd, tmp.c_str(), 0);
+    return err;
+}
+
+int Extractor::deploy(const std::string& hash, const std::string& path, unsigned mode, int64_t mtime) {
+    std::string obj = objectPath(hash);
+    int src = ::openat(storefd, obj.c_str(), O_RDONLY | O_CLOEXEC);
+    if (src < 0) return errno;
+    struct stat st;
+    if (::fstat(src, &st) != 0) {
+        int err = errno;
+        ::close(src);
+        return err;
+    }
+
+    bool share = !reflinks && (st.st_mode & 07777) == mode;
+    if (!share) {
+        int dst = createFile(path);
+        if (dst < 0) {
+            ::close(src);
+            return -dst;
+        }
+        int err = 0;
+        if (reflinks && ::ioctl(dst, FICLONE, src) == 0) {
+            ::close(src);
+            return closeFile(dst, mode, mtime);
+        }
+        if (reflinks) {
+            err = errno;
+            if (err == EOPNOTSUPP || err == EXDEV || err == EINVAL || err == ENOTTY) {
+                reflinks = false;
+                err = 0;
+            }
+        }
+        if (!err && (st.st_mode & 07777) == mode) {
+            ::close(dst);
+            ::unlinkat(dirfd, path.c_str(), 0);
+            share = true;
+        } else {
+            // no reflinks and the mode differs: a plain copy
+            for (off_t done = 0; !err && done < st.st_size;) {
+                ssize_t n = ::copy_file_range(src, nullptr, dst, nullptr, st.st_size - done, 0);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) err = n < 0 ? errno : EIO;
+                else done += n;
+            }
+            ::close(src);
+            int cerr = closeFile(dst, mode, mtime);
+            return err ? err : cerr;
+        }
+    }
+    ::close(src);
+    ::unlinkat(dirfd, path.c_str(), 0);
+    return ::linkat(storefd, obj.c_str(), dirfd, path.c_str(), 0) == 0 ? 0 : errno;
+}
+
+// A pooled file's body, in memory, into the store and out to its path.
+int Extractor::storeData(const Job& job, const std::string& hash) {
+    if (!haveObject(hash)) {
+        std::string tmp;
+        int fd = newObject(tmp);
+        if (fd < 0) return -fd;
+        int err = 0;
+        for (size_t done = 0; !err && done < job.size;) {
+            ssize_t w = ::write(fd, job.body + done, job.size - done);
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0) err = errno;
+            else done += (size_t)w;
+        }
+        int cerr = closeFile(fd, job.mode, job.mtime);
+        if (int perr = publish(tmp, hash, err ? err : cerr)) return perr;
+        written += job.size;
+    } else {
+        reused += job.size;
+    }
+    return deploy(hash, job.path, job.mode, job.mtime);
+}
+
+int Extractor::createFile(const std::string& path) {
+    ::unlinkat(dirfd, path.c_str(), 0);
+    int fd = ::openat(dirfd, path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    return fd < 0 ? -errno : fd;
+}
+
+int Extractor::closeFile(int fd, unsigned mode, int64_t mtime) {
+    int err = 0;
+    struct timespec times[2] = {{0, UTIME_OMIT}, {(time_t)mtime, 0}};
+    if (::fchmod(fd, mode) != 0) err = errno;
+    ::futimens(fd, times);
+    if (::close(fd) != 0 && !err) err = errno;
+    return err;
+}
+
+void Extractor::worker() {
+    std::unique_lock<std::mutex> lock(m);
+    for (;;) {
+        work.wait(lock, [this] { return stopping || !jobs.empty(); });
+        if (jobs.empty()) return;
+        Job job = std::move(jobs.front());
+        jobs.pop_front();
+        ++busy;
+        lock.unlock();
+
+        int err = 0;
+        Sha256 sha;
+        sha.update(job.body, job.size);
+        std::string digest = sha.hex();
+        int fd = -1;
+        if (!job.sha256.empty() && digest != job.sha256)
+            err = EBADMSG;
+        else if (storefd >= 0)
+            err = storeData(job, digest);
+        else if ((fd = createFile(job.path)) < 0)
+            err = -fd;
+        if (fd >= 0) {
+            for (size_t done = 0; !err && done < job.size;) {
+                ssize_t w = ::write(fd, job.body + done, job.size - done);
+                if (w < 0 && errno == EINTR) continue;
+                if (w < 0) err = errno;
+                else done += (size_t)w;
+            }
+            int cerr = closeFile(fd, job.mode, job.mtime);
+            if (!err) err = cerr;
+            written += job.size;
+        }
+
+        lock.lock();
+        --busy;
+        queued -= job.data.size();
+        if (err) failures.push_back({job.index, err});
+        else digests.push_back({job.index, std::move(digest)});
+        space.notify_one();
+        if (jobs.empty() && busy == 0) idle.notify_all();
+    }
+}
+
+void Extractor::enqueue(Job job) {
+    if (ring && storefd < 0) {
+        inFlight.insert(job.path);
+        batched += job.data.size();
+        batch.push_back(std::move(job));
+        if (batch.size() == ringDepth || batched >= pooledBytes) flushBatch();
+        return;
+    }
+    std::unique_lock<std::mutex> lock(m);
+    space.wait(lock, [&] { return jobs.empty() || queued + job.data.size() <= pooledBytes; });
+    inFlight.insert(job.path);
+    queued += job.data.size();
+    jobs.push_back(std::move(job));
+    work.notify_one();
+}
+
+// Files are created with their final mode, so chmod is only needed where
+// the umask took bits away. A batch that cannot be submitted at all turns
+// io_uring off for the rest of the extraction.
+void Extractor::flushBatch() {
+    if (batch.empty()) return;
+    std::vector<int> err(batch.size(), 0);
+    std::vector<std::string> digest(batch.size());
+    for (size_t i = 0; i < batch.size(); ++i) {
+        const Job& job = batch[i];
+        Sha256 sha;
+        sha.update(job.body, job.size);
+        digest[i] = sha.hex();
+        if (!job.sha256.empty() && digest[i] != job.sha256) err[i] = EBADMSG;
+    }
+
+    // user_data: the file's place in the batch, and which step of its chain
+    for (size_t i = 0; i < batch.size(); ++i) {
+        if (err[i]) continue;
+        const Job& job = batch[i];
+        const char* path = job.path.c_str();
+        unsigned slot = (unsigned)i;
+        ring->unlinkAt(dirfd, path, i << 2, Uring::Always);
+        // direct descriptors are never inherited, and refuse O_CLOEXEC
+        ring->openAt(dirfd, path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, job.mode, slot,
+                     i << 2 | 1, Uring::Next);
+        if (job.size > 0) ring->write(slot, job.body, (unsigned)job.size, 0, i << 2 | 2, Uring::Next);
+        ring->close(slot, i << 2 | 3, Uring::End);
+    }
+    bool submitted = ring->run([&](uint64_t data, int res) {
+        size_t i = data >> 2;
+        int step = data & 3;
+        if (step == 0 || err[i]) return;
+        if (res < 0) err[i] = res == -ECANCELED ? EIO : -res;
+        else if (step == 2 && (size_t)res != batch[i].size) err[i] = EIO;   // a short write
+    });
+    if (!submitted) ring.reset();
+
+    for (size_t i = 0; i < batch.size(); ++i) {
+        Job& job = batch[i];
+        if (!submitted && !err[i]) err[i] = EIO;
+        if (!err[i] && (job.mode & ~umaskBits) != job.mode
+            && ::fchmodat(dirfd, job.path.c_str(), job.mode, 0) != 0)
+            err[i] = errno;
+        if (!err[i]) {
+            struct timespec times[2] = {{0, UTIME_OMIT}, {(time_t)job.mtime, 0}};
+            ::utimensat(dirfd, job.path.c_str(), times, AT_SYMLINK_NOFOLLOW);
+            written += job.size;
+            digests.push_back({job.index, std::move(digest[i])});
+        } else {
+            failures.push_back({job.index, err[i]});
+        }
+        inFlight.erase(job.path);
+    }
+    batch.clear();
+    batched = 0;
+}
+
+void Extractor::drain() {
+    if (ring) flushBatch();
+    std::unique_lock<std::mutex> lock(m);
+    idle.wait(lock, [this] { return jobs.empty() && busy == 0; });
+    inFlight.clear();
+}
+
+bool Extractor::readBlock(Source& in, char* block) {
+    size_t got = 0;
+    while (got < blockSize) {
+        size_t r = in.read(block + got, blockSize - got);
+        if (r == 0) return false;
+        got += r;
+    }
+    return true;
+}
+
+bool Extractor::skip(Source& in, uint64_t size) {
+    while (size > 0) {
+        size_t r = in.read(buf.data(), (size_t)std::min<uint64_t>(size, buf.size()));
+        if (r == 0) return false;
+        size -= r;
+    }
+    return true;
+}
+
+bool Extractor::readString(Source& in, uint64_t size, std::string& out) {
+    uint64_t padded = (size + blockSize - 1) / blockSize * blockSize;
+    if (padded > (64 << 20)) return false;
+    out.resize(padded);
+    size_t got = 0;
+    while (got < padded) {
+        size_t r = in.read(&out[got], padded - got);
+        if (r == 0) return false;
+        got += r;
+    }
+    out.resize(strnlen(out.data(), size));
+    return true;
+}
+
+// Reads the next member header, folding in pax and GNU long-name records.
+bool Extractor::next(Source& in, Entry& e, bool& end) {
+    Entry pending;
+    bool hasPath = false, hasLink = false, hasSize = false;
+    char h[blockSize];
+
+    for (;;) {
+        if (!readBlock(in, h)) {
+            message = "truncated archive";
+            return false;
+        }
+        bool zero = true;
+        for (size_t i = 0; i < blockSize && zero; ++i) zero = h[i] == 0;
+        if (zero) {
+            end = true;
+            return true;
+        }
+        if (!checksumOk(h)) {
+            message = "bad tar header checksum";
+            return false;
+        }
+
+        char type = h[156] ? h[156] : '0';
+        uint64_t size = number(h + 124, 12);
+        std::string data;
+
+        if (type == 'x' || type == 'g' || type == 'L' || type == 'K') {
+            if (!readString(in, size, data)) {
+                message = "truncated archive";
+                return false;
+            }
+            if (type == 'x') {
+                parsePax(data, pending, hasSize);
+                hasPath = hasPath || !pending.path.empty();
+                hasLink = hasLink || !pending.link.empty();
+            } else if (type == 'L') {
+                pending.path = data;
+                hasPath = true;
+            } else if (type == 'K') {
+                pending.link = data;
+                hasLink = true;
+            }
+            continue;
+        }
+
+        e = Entry{};
+        e.type = type == '7' ? '0' : type;
+        e.mode = (unsigned)number(h + 100, 8) & 07777;
+        e.size = hasSize ? pending.size : size;
+        e.mtime = pending.mtime ? pending.mtime : (int64_t)number(h + 136, 12);
+        if (hasPath) {
+            e.path = pending.path;
+        } else {
+            e.path = field(h, 100);
+            std::string prefix = field(h + 345, 155);
+            if (memcmp(h + 257, "ustar", 5) == 0 && !prefix.empty())
+                e.path = prefix + "/" + e.path;
+        }
+        e.link = hasLink ? pending.link : field(h + 157, 100);
+        e.sha256 = pending.sha256;
+        return true;
+    }
+}
+
+int Extractor::makeDir(const std::string& path, unsigned mode, int64_t mtime) {
+    if (path.empty() || knownDirs.count(path)) return 0;
+    if (int err = makeParents(path)) return err;
+    if (::mkdirat(dirfd, path.c_str(), 0700) == 0) {
+        madeDirs.push_back({path, mode ? mode : 0755, mtime});
+    } else {
+        struct stat st;
+        if (errno != EEXIST) return errno;
+        // a symlink in its place is refused, not followed, wherever it points
+        if (::fstatat(dirfd, path.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISDIR(st.st_mode)) return ENOTDIR;
+    }
+    knownDirs.insert(path);
+    return 0;
+}
+
+// For a path the archive only refers to, a hardlink's target: every
+// directory on the way must be a real one, as for the paths it creates.
+int Extractor::realParents(const std::string& path) {
+    for (size_t slash = path.find('/'); slash != std::string::npos; slash = path.find('/', slash + 1)) {
+        std::string dir = path.substr(0, slash);
+        if (knownDirs.count(dir)) continue;
+        struct stat st;
+        if (::fstatat(dirfd, dir.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) return errno;
+        if (!S_ISDIR(st.st_mode)) return ENOTDIR;
+        knownDirs.insert(dir);
+    }
+    return 0;
+}
+
+int Extractor::makeParents(const std::string& path) {
+    size_t slash = path.rfind('/');
+    if (slash == std::string::npos) return 0;
+    return makeDir(path.substr(0, slash), 0755, 0);
+}
+
+// Reads a small file's body and leaves the writing to the pool.
+bool Extractor::queueFile(Source& in, Entry& e) {
+    Job job{results.size(), e.path, e.mode, e.mtime, {}, e.sha256};
+    job.size = e.size;
+    if (!(job.body = in.view(job.size))) {
+        job.data.resize(job.size);
+        size_t got = 0;
+        while (got < job.size) {
+            size_t r = in.read(job.data.data() + got, job.size - got);
+            if (r == 0) {
+                message = "truncated archive";
+                return false;
+            }
+            got += r;
+        }
+        job.body = job.data.data();
+    }
+    if (!e.error) enqueue(std::move(job));
+    return skip(in, (blockSize - e.size % blockSize) % blockSize);
+}
+
+bool Extractor::writeFile(Source& in, Entry& e) {
+    uint64_t padded = (e.size + blockSize - 1) / blockSize * blockSize;
+    if (storefd >= 0 && !e.error && haveObject(e.sha256)) {
+        // stored already: the body is not needed
+        if (!skip(in, padded)) {
+            message = "truncated archive";
+            return false;
+        }
+        e.error = deploy(e.sha256, e.path, e.mode, e.mtime);
+        reused += e.size;
+        return true;
+    }
+    if ((!workers.empty() || (ring && storefd < 0)) && e.size <= pooledFile)
+        return queueFile(in, e);
+
+    int fd = -1;
+    std::string tmp;
+    if (!e.error) {
+        fd = storefd >= 0 ? newObject(tmp) : createFile(e.path);
+        if (fd < 0) {
+            e.error = -fd;
+            fd = -1;
+        }
+    }
+
+    Sha256 sha;
+    uint64_t left = e.size;
+    while (left > 0) {
+        size_t want = (size_t)std::min<uint64_t>(left, buf.size());
+        size_t got = want;
+        const char* data = in.view(want);
+        if (!data) {
+            for (got = 0; got < want;) {
+                size_t r = in.read(buf.data() + got, want - got);
+                if (r == 0) {
+                    if (fd >= 0) ::close(fd);
+                    message = "truncated archive";
+                    return false;
+                }
+                got += r;
+            }
+            data = buf.data();
+        }
+        sha.update(data, got);
+        for (size_t done = 0; fd >= 0 && !e.error && done < got;) {
+            ssize_t w = ::write(fd, data + done, got - done);
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0) e.error = errno;
+            else done += (size_t)w;
+        }
+        left -= got;
+    }
+
+    std::string digest = sha.hex();
+    if (!e.error && !e.sha256.empty() && digest != e.sha256) e.error = EBADMSG;
+    if (fd >= 0) {
+        int err = closeFile(fd, e.mode, e.mtime);
+        if (!e.error) e.error = err;
+        if (storefd >= 0) {
+            e.error = publish(tmp, digest, e.error);
+            if (!e.error) e.error = deploy(digest, e.path, e.mode, e.mtime);
+        }
+        if (!e.error) written += e.size;
+    }
+    if (!e.error) e.sha256 = digest;
+    return skip(in, (blockSize - e.size % blockSize) % blockSize);
+}
+
+// Directories get their final mode and mtime only once everything inside
+// them exists, and only if this archive created them.
+void Extractor::finishDirs() {
+    for (auto it = madeDirs.rbegin(); it != madeDirs.rend(); ++it) {
+        ::fchmodat(dirfd, it->path.c_str(), it->mode, 0);
+        if (it->mtime) {
+            struct timespec times[2] = {{0, UTIME_OMIT}, {(time_t)it->mtime, 0}};
+            ::utimensat(dirfd, it->path.c_str(), times, AT_SYMLINK_NOFOLLOW);
+        }
+    }
+    madeDirs.clear();
+}
+
+bool Extractor::extract(Source& in) {
+    if (dirfd < 0) return false;
+
+    bool ok = true;
+    for (;;) {
+        Entry e;
+        bool end = false;
+        if (!next(in, e, end)) {
+            ok = false;
+            break;
+        }
+        if (end) break;
+
+        if (!cleanPath(e.path)) {
+            e.error = EPERM;
+        } else if (e.type == '1' && !cleanPath(e.link)) {
+            e.error = EPERM;
+        } else if (inFlight.count(e.path) || (e.type == '1' && inFlight.count(e.link))) {
+            drain();
+        }
+        if (e.path.empty() && !e.error) {
+            // the archive root ("./") stands for dest itself; leave it be
+            if (!skip(in, (e.size + blockSize - 1) / blockSize * blockSize)) {
+                message = "truncated archive";
+                ok = false;
+                break;
+            }
+            continue;
+        }
+
+        if (e.type == '0') {
+            if (!e.error) e.error = makeParents(e.path);
+            if (!writeFile(in, e)) {
+                ok = false;
+                break;
+            }
+        } else {
+            if (e.type != '5' && !skip(in, (e.size + blockSize - 1) / blockSize * blockSize)) {
+                message = "truncated archive";
+                ok = false;
+                break;
+            }
+            if (!e.error) e.error = e.type == '5' ? makeDir(e.path, e.mode, e.mtime) : makeParents(e.path);
+            if (!e.error) {
+                switch (e.type) {
+                case '5':
+                    break;
+                case '2':
+                    ::unlinkat(dirfd, e.path.c_str(), 0);
+                    if (::symlinkat(e.link.c_str(), dirfd, e.path.c_str()) != 0) e.error = errno;
+                    break;
+                case '1':
+                    if ((e.error = realParents(e.link))) break;
+                    ::unlinkat(dirfd, e.path.c_str(), 0);
+                    if (::linkat(dirfd, e.link.c_str(), dirfd, e.path.c_str(), 0) != 0) e.error = errno;
+                    break;
+                case '6':
+                    ::unlinkat(dirfd, e.path.c_str(), 0);
+                    if (::mkfifoat(dirfd, e.path.c_str(), e.mode) != 0) e.error = errno;
+                    break;
+                default:
+                    e.error = ENOTSUP;   // device nodes and unknown types
+                }
+            }
+        }
+        if (e.error) ok = false;
+        results.push_back(std::move(e));
+    }
+    drain();
+    for (auto& [index, err] : failures) {
+        results[index].error = err;
+        ok = false;
+    }
+    for (auto& [index, digest] : digests) results[index].sha256 = std::move(digest);
+    failures.clear();
+    digests.clear();
+    finishDirs();
+
+    // drain the record padding so a streaming producer is not left waiting
+    while (in.read(buf.data(), buf.size()) > 0) {}
+    if (in.failed()) {
+        if (message.empty()) message = "archive stream failed";
+        ok = false;
+    }
+    return ok;
+}
+
+TarWriter::TarWriter(std::function<bool(const char*, size_t)> out) : out(std::move(out)), buf(1 << 20) {}
+
+bool TarWriter::emit(const char* data, size_t n) {
+    offset += n;
+    return out(data, n);
+}
+
+static std::string paxRecord(const std::string& key, const std::string& value) {
+    // the length prefix counts itself
+    std::string body = " " + key + "=" + value + "\n";
+    size_t len = body.size() + 1;
+    while (std::to_string(len).size() + body.size() != len) ++len;
+    return std::to_string(len) + body;
+}
+
+bool TarWriter::pad(uint64_t size) {
+    static const char zeros[blockSize] = {};
+    size_t n = (blockSize - size % blockSize) % blockSize;
+    return n == 0 || emit(zeros, n);
+}
+
+bool TarWriter::header(const std::string& path, char type, unsigned mode, uint64_t size,
+                       int64_t mtime, const std::string& link, const std::string& sha256) {
+    std::string pax;
+    if (!sha256.empty()) pax += paxRecord(paxDigest, sha256);
+    if (path.size() > 100) pax += paxRecord("path", path);
+    if (link.size() > 100) pax += paxRecord("linkpath", link);
+    if (size > 077777777777ULL) pax += paxRecord("size", std::to_string(size));
+    // the ustar field holds 0 to 8^11 - 1; anything else goes in a pax record
+    bool timeFits = mtime >= 0 && mtime <= 077777777777LL;
+    if (!timeFits) pax += paxRecord("mtime", std::to_string(mtime));
+    if (!pax.empty()) {
+        if (!header("././@PaxHeader", 'x', 0644, pax.size(), timeFits ? mtime : 0, "")) return false;
+        if (!emit(pax.data(), pax.size()) || !pad(pax.size())) return false;
+    }
+
+    char h[blockSize] = {};
+    memcpy(h, path.data(), std::min<size_t>(path.size(), 100));
+    snprintf(h + 100, 8, "%07o", mode & 07777);
+    snprintf(h + 108, 8, "%07o", 0);
+    snprintf(h + 116, 8, "%07o", 0);
+    snprintf(h + 124, 12, "%011llo", (unsigned long long)(size > 077777777777ULL ? 0 : size));
+    snprintf(h + 136, 12, "%011llo", (unsigned long long)(timeFits ? mtime : 0) & 077777777777ULL);
+    h[156] = type;
+    memcpy(h + 157, link.data(), std::min<size_t>(link.size(), 100));
+    memcpy(h + 257, "ustar\0" "00", 8);
+    memcpy(h + 265, "root", 4);
+    memcpy(h + 297, "root", 4);
+    memset(h + 148, ' ', 8);
+    unsigned sum = 0;
+    for (size_t i = 0; i < blockSize; ++i) sum += (unsigned char)h[i];
+    snprintf(h + 148, 8, "%06o", sum);
+    if (!emit(h, blockSize)) return false;
+
+    if (type != 'x') {
+        Entry e;
+        e.path = type == '5' ? path.substr(0, path.size() - 1) : path;
+        e.type = type;
+        e.mode = mode;
+        e.size = size;
+        e.mtime = mtime;
+        e.link = link;
+        e.offset = offset;
+        written.push_back(std::move(e));
+    }
+    return true;
+}
+
+bool TarWriter::addTree(const std::string& root) {
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    std::vector<std::string> paths;
+    // relative by name alone: resolving the path would turn a symlink into
+    // whatever it points at
+    for (auto it = fs::recursive_directory_iterator(root, ec); !ec && it != fs::recursive_directory_iterator(); it.increment(ec))
+        paths.push_back(it->path().lexically_relative(root).string());
+    if (ec) {
+        message = root + ": " + ec.message();
+        return false;
+    }
+    // sorted, so a directory always comes before what it contains
+    std::sort(paths.begin(), paths.end());
+
+    std::map<std::pair<dev_t, ino_t>, std::string> seen;
+    for (auto& rel : paths) {
+        std::string full = root + "/" + rel;
+        struct stat st;
+        if (::lstat(full.c_str(), &st) != 0) {
+            message = full + ": " + strerror(errno);
+            return false;
+        }
+        unsigned mode = st.st_mode & 07777;
+        bool ok;
+        if (S_ISDIR(st.st_mode)) {
+            ok = header(rel + "/", '5', mode, 0, st.st_mtime, "");
+        } else if (S_ISLNK(st.st_mode)) {
+            std::string target(st.st_size + 1, '\0');
+            ssize_t n = ::readlink(full.c_str(), &target[0], target.size());
+            if (n < 0) {
+                message = full + ": " + strerror(errno);
+                return false;
+            }
+            target.resize(n);
+            ok = header(rel, '2', mode, 0, st.st_mtime, target);
+        } else if (S_ISREG(st.st_mode)) {
+            auto key = std::make_pair(st.st_dev, st.st_ino);
+            if (st.st_nlink > 1 && seen.count(key)) {
+                ok = header(rel, '1', mode, 0, st.st_mtime, seen[key]);
+            } else {
+                if (st.st_nlink > 1) seen[key] = rel;
+                // hashed up front so the hash can precede the body
+                std::string digest = Sha256::file(full);
+                FileSource in(full);
+                Sha256 sha;
+                ok = !digest.empty() && !in.failed() && header(rel, '0', mode, st.st_size, st.st_mtime, "", digest);
+                uint64_t left = st.st_size;
+                while (ok && left > 0) {
+                    size_t r = in.read(buf.data(), (size_t)std::min<uint64_t>(left, buf.size()));
+                    ok = r > 0 && emit(buf.data(), r);
+                    sha.update(buf.data(), r);
+                    left -= r;
+                }
+                ok = ok && pad(st.st_size);
+                if (ok && sha.hex() != digest) {
+                    message = full + " changed while it was being packed";
+                    return false;
+                }
+                if (ok) written.back().sha256 = digest;
+                if (!ok && message.empty()) message = "cannot read " + full;
+            }
+        } else {
+            continue;   // sockets, devices, fifos are not packaged
+        }
+        if (!ok) {
+            if (message.empty()) message = "write failed";
+            return false;
+        }
+    }
+    return true;
+}
+
+bool TarWriter::finish() {
+    static const char zeros[2 * blockSize] = {};
+    if (!emit(zeros, sizeof(zeros))) {
+        message = "write failed";
+        return false;
+    }
+    return true;
+}
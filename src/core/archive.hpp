@@ -0,0 +1,180 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+#include <memory>
+#include "stream.hpp"
+
+class Uring;
+
+struct Entry {
+    std::string path;       // relative to the destination
+    char type = '0';        // tar typeflag: '0' file, '1' hardlink, '2' symlink, '5' dir
+    unsigned mode = 0;
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    std::string link;       // symlink or hardlink target
+    int error = 0;          // errno from extracting it, 0 on success
+    uint64_t offset = 0;    // where the body starts in the uncompressed tar stream
+    std::string sha256;     // of the body, for regular files when known
+};
+
+// Reads a ustar / pax / GNU tar stream and recreates it under dest. All
+// filesystem calls are relative to one directory fd, and every file body
+// goes through the same I/O buffer. Entries that fail are recorded and
+// skipped; a malformed or truncated archive stops extraction. No symlink
+// is ever followed on the way to a member: one the archive made earlier
+// where a directory should be fails that member with ENOTDIR, so nothing
+// lands outside dest.
+//
+// With threads > 1 the archive is still read on the calling thread, which
+// also creates directories, symlinks and hardlinks in archive order, but
+// the bodies of small files are handed to a pool of workers that do the
+// create / write / chmod / close. A hardlink, or a second entry for the
+// same path, waits until the writes it depends on are done.
+//
+// With io_uring set, small files are gathered into batches instead, each
+// submitted as unlink / open / write / close chains on direct descriptors
+// and waited for together; chmod (only where the umask changed the mode)
+// and the mtime remain one system call each, as io_uring has no ops for
+// them. It is not used together with a store.
+//
+// A source that can view() its bytes in place (a mapped, uncompressed
+// archive) has file bodies written and hashed straight from it, never
+// copied into a buffer first.
+//
+// Regular files are hashed as they are written; entries() carries the
+// SHA-256 of every file that was extracted. A file whose archive entry
+// names its hash (a PACMANOC.sha256 pax record) and does not match it fails
+// with EBADMSG.
+//
+// With a store set, file bodies are kept once per content under
+// store/objects/<hash> and the destination gets a reflink (FICLONE) of the
+// object, or a hardlink where reflinks are not supported. A body whose
+// hash is known up front and already stored is skipped, not written. A
+// hardlink shares its mode and mtime with the object, so a file whose mode
+// differs from the stored object's is copied instead.
+class Extractor {
+public:
+    explicit Extractor(const std::string& dest, int threads = 1);
+    ~Extractor();
+    Extractor(const Extractor&) = delete;
+    Extractor& operator=(const Extractor&) = delete;
+
+    // false (and no store used) when it is not on dest's filesystem
+    bool setStore(const std::string& dir);
+    // false (and the plain system calls used) when io_uring is unavailable
+    bool setUring(unsigned depth = 128);
+    bool extract(Source& in);
+    uint64_t bytesWritten() const { return written; }
+    uint64_t bytesReused() const { return reused; }
+
+    const std::vector<Entry>& entries() const { return results; }
+    const std::string& error() const { return message; }
+
+private:
+    struct Dir {
+        std::string path;
+        unsigned mode;
+        int64_t mtime;
+    };
+
+    // body points into data, or straight into the source when it could
+    // hand the bytes out in place
+    struct Job {
+        size_t index;
+        std::string path;
+        unsigned mode;
+        int64_t mtime;
+        std::vector<char> data;
+        std::string sha256;
+        const char* body = nullptr;
+        size_t size = 0;
+    };
+
+    int dirfd = -1;
+    int storefd = -1;
+    std::atomic<bool> reflinks{true};
+    std::atomic<uint64_t> tmpCount{0};
+    std::atomic<uint64_t> written{0};
+    std::atomic<uint64_t> reused{0};
+    std::vector<char> buf;
+    std::vector<Entry> results;
+    std::vector<Dir> madeDirs;
+    std::unordered_set<std::string> knownDirs;
+    std::string message;
+
+    std::vector<std::thread> workers;
+    std::mutex m;
+    std::condition_variable work, space, idle;
+    std::deque<Job> jobs;
+    size_t queued = 0;
+    int busy = 0;
+    bool stopping = false;
+    std::unordered_set<std::string> inFlight;
+    std::vector<std::pair<size_t, int>> failures;
+    std::vector<std::pair<size_t, std::string>> digests;
+
+    std::unique_ptr<Uring> ring;
+    unsigned ringDepth = 0;
+    unsigned umaskBits = 0;
+    std::vector<Job> batch;
+    size_t batched = 0;
+
+    void worker();
+    void enqueue(Job job);
+    void drain();
+    void flushBatch();
+    int createFile(const std::string& path);
+    int closeFile(int fd, unsigned mode, int64_t mtime);
+    bool haveObject(const std::string& hash);
+    int newObject(std::string& tmp);
+    int publish(const std::string& tmp, const std::string& hash, int err);
+    int deploy(const std::string& hash, const std::string& path, unsigned mode, int64_t mtime);
+    int storeData(const Job& job, const std::string& hash);
+    bool next(Source& in, Entry& e, bool& end);
+    bool readBlock(Source& in, char* block);
+    bool readString(Source& in, uint64_t size, std::string& out);
+    bool skip(Source& in, uint64_t size);
+    bool writeFile(Source& in, Entry& e);
+    bool queueFile(Source& in, Entry& e);
+    int makeDir(const std::string& path, unsigned mode, int64_t mtime);
+    int makeParents(const std::string& path);
+    int realParents(const std::string& path);
+    void finishDirs();
+};
+
+// Writes a directory tree as a tar stream: ustar headers, with pax records
+// for names that do not fit. Owners are written as root; files that share
+// an inode become hardlinks to the first of them, and a symlink is written
+// as one, with its target as it stands, never followed. Each file's
+// SHA-256 goes into a pax record ahead of its body, and every member
+// written is listed in entries(), with its body offset and hash.
+class TarWriter {
+public:
+    explicit TarWriter(std::function<bool(const char*, size_t)> out);
+
+    bool addTree(const std::string& root);
+    bool finish();
+    const std::vector<Entry>& entries() const { return written; }
+    const std::string& error() const { return message; }
+
+private:
+    std::function<bool(const char*, size_t)> out;
+    std::vector<char> buf;
+    std::vector<Entry> written;
+    uint64_t offset = 0;
+    std::string message;
+
+    bool emit(const char* data, size_t n);
+    bool header(const std::string& path, char type, unsigned mode, uint64_t size,
+                int64_t mtime, const std::string& link, const std::string& sha256 = "");
+    bool pad(uint64_t size);
+};
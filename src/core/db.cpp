@@ -1,50 +1,699 @@
 #include "db.hpp"
+#include "archive.hpp"
 #include <fstream>
 #include <filesystem>
+#include <iostream>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <zlib.h>
 using json = nlohmann::json;
 namespace fs = std::filesystem;
 
+namespace {
+
+const char dbMagic[4] = {'O', 'C', 'D', 'B'};
+const uint32_t dbVersion = 2;
+// firstFile of a package installed before manifests were kept
+const uint32_t noManifest = 0xffffffff;
+// package records in version 1 stopped before size and installTime
+const size_t recordSize = 48;
+const size_t recordSizeV1 = 32;
+// the journal is folded into db.bin once it is bigger than this and db.bin
+const size_t compactAt = 256 << 10;
+
+struct Str {
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct Header {
+    char magic[4];
+    uint32_t version;
+    uint32_t packages;
+    uint32_t files;
+    uint64_t heapOffset;
+    uint64_t heapSize;
+};
+
+struct FileRecord {
+    Str path;
+    Str link;
+    uint64_t size;
+    uint32_t mode;
+    uint8_t type;
+    uint8_t hashed;
+    uint16_t pad;
+    uint8_t sha256[32];
+};
+
+static_assert(sizeof(Header) == 32 && sizeof(FileRecord) == 64, "db.bin layout");
+
+const char* typeName(uint8_t t) {
+    return t == '5' ? "dir" : t == '2' ? "symlink" : t == '1' ? "hardlink" : t == '6' ? "fifo" : "file";
+}
+
+uint8_t typeCode(const std::string& t) {
+    return t == "dir" ? '5' : t == "symlink" ? '2' : t == "hardlink" ? '1' : t == "fifo" ? '6' : '0';
+}
+
+bool unhex(const std::string& hex, uint8_t* out) {
+    if (hex.size() != 64) return false;
+    for (size_t i = 0; i < 32; ++i) {
+        unsigned v;
+        if (sscanf(hex.c_str() + 2 * i, "%2x", &v) != 1) return false;
+        out[i] = (uint8_t)v;
+    }
+    return true;
+}
+
+bool writeAll(int fd, const void* data, size_t n) {
+    const char* p = (const char*)data;
+    while (n > 0) {
+        ssize_t w = ::write(fd, p, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        p += w;
+        n -= (size_t)w;
+    }
+    return true;
+}
+
+// makes a rename or a newly created file in dir survive a crash
+bool syncDir(const std::string& dir) {
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return false;
+    bool ok = ::fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+}
+
+// db.bin's inode and mtime, which a compaction changes, and the journal's
+// length, which every save changes
+void fileStamp(const std::string& bin, const std::string& journal, uint64_t& inode, int64_t& time,
+               int64_t& journalBytes) {
+    struct stat st;
+    inode = 0;
+    time = 0;
+    if (::stat(bin.c_str(), &st) == 0) {
+        inode = st.st_ino;
+        time = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    }
+    journalBytes = ::stat(journal.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+// flock on db.lock, which unlike db.bin is never replaced; held until it
+// goes out of scope. A reader that may not create the file goes unlocked.
+struct FileLock {
+    int fd;
+    FileLock(const std::string& path, int how) {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd >= 0)
+            while (::flock(fd, how) != 0 && errno == EINTR) {}
+    }
+    ~FileLock() {
+        if (fd >= 0) ::close(fd);
+    }
+    FileLock(const FileLock&) = delete;
+    FileLock& operator=(const FileLock&) = delete;
+};
+
+} // namespace
+
+struct Database::Record {
+    Str name;
+    Str version;
+    Str destination;
+    uint32_t firstFile;
+    uint32_t fileCount;
+    uint64_t size;
+    int64_t installTime;
+};
+
+static const Header& header(const char* map) {
+    return *(const Header*)map;
+}
+
+// a string out of the heap; anything pointing outside it reads as empty
+static std::string_view text(const char* map, Str s) {
+    const Header& h = header(map);
+    if ((uint64_t)s.offset + s.length > h.heapSize) return {};
+    return std::string_view(map + h.heapOffset + s.offset, s.length);
+}
+
+template <typename T>
+static const T* table(const char* map, size_t offset) {
+    return (const T*)(map + offset);
+}
+
+static size_t stride(const char* map) {
+    return header(map).version == 1 ? recordSizeV1 : recordSize;
+}
+
+static const FileRecord* fileTable(const char* map) {
+    return table<FileRecord>(map, sizeof(Header) + header(map).packages * stride(map));
+}
+
+Database::~Database() {
+    close();
+}
+
+bool Database::open() {
+    static_assert(sizeof(Record) == recordSize, "db.bin layout");
+    int fd = ::open(dbPath.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || ::fstat(fd, &st) != 0) {
+        if (fd >= 0) ::close(fd);
+        return false;
+    }
+    mapSize = (size_t)st.st_size;
+    void* p = mapSize >= sizeof(Header) ? ::mmap(nullptr, mapSize, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (p == MAP_FAILED) return false;
+    map = (const char*)p;
+
+    const Header& h = header(map);
+    uint64_t tables = sizeof(Header) + (uint64_t)h.packages * stride(map) + (uint64_t)h.files * sizeof(FileRecord);
+    if (memcmp(h.magic, dbMagic, 4) != 0 || h.version < 1 || h.version > dbVersion
+        || h.heapOffset < tables || h.heapOffset + h.heapSize > mapSize) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void Database::close() {
+    if (map) ::munmap((void*)map, mapSize);
+    map = nullptr;
+    mapSize = 0;
+}
+
 void Database::load() {
-    if (!fs::exists(dbPath)) {
-        fs::create_directories(fs::path(dbPath).parent_path());
-        std::ofstream(dbPath) << "{}";
+    std::error_code ec;
+    fs::create_directories(fs::path(lockPath).parent_path(), ec);
+    // converting a db.json writes, so that needs the lock to itself
+    bool convert = !fs::exists(dbPath) && fs::exists(jsonPath);
+    FileLock lock(lockPath, convert ? LOCK_EX : LOCK_SH);
+    read();
+}
+
+void Database::read() {
+    close();
+    added.clear();
+    removed.clear();
+    pending.clear();
+    before.clear();
+    broken = false;
+
+    if (!fs::exists(dbPath) && fs::exists(jsonPath)) {
+        // a database from before db.bin: convert it once, keep the original
+        std::ifstream f(jsonPath);
+        json data = json::parse(f, nullptr, false);
+        if (!data.is_object()) {
+            std::cerr << "[ERROR] cannot read " << jsonPath << "\n";
+            broken = true;
+            return;
+        }
+        for (auto& [k, v] : data.items())
+            addJSON(k, v);
+        replay();
+        if (compact()) {
+            std::error_code ec;
+            fs::rename(jsonPath, jsonPath + ".old", ec);
+            std::cout << "[INFO] converted " << jsonPath << " to " << dbPath << "\n";
+        }
+        stamp();
+        return;
+    }
+    if (fs::exists(dbPath) && !open()) {
+        std::cerr << "[ERROR] " << dbPath << " is damaged\n";
+        broken = true;
+        return;
+    }
+    replay();
+    stamp();
+}
+
+void Database::stamp() {
+    fileStamp(dbPath, journalPath, binInode, binTime, journalSeen);
+}
+
+bool Database::stale() const {
+    uint64_t inode;
+    int64_t time, journal;
+    fileStamp(dbPath, journalPath, inode, time, journal);
+    return inode != binInode || time != binTime || journal != journalSeen;
+}
+
+// Another pacmanoc saved since this one loaded: read what it wrote and put
+// this one's changes back on top.
+void Database::merge() {
+    std::unordered_map<std::string, json> mine;
+    PackageView v;
+    for (auto& name : pending)
+        if (added.get(name, v)) mine[name] = toJSON(v, added.files(name));
+    std::unordered_set<std::string> names = std::move(pending);
+    std::unordered_map<std::string, std::string> was = std::move(before);
+
+    read();
+    if (broken) return;
+    for (auto& name : names) {
+        track(name);
+        if (before[name] != was[name])
+            std::cerr << "[WARN] another pacmanoc changed " << name << " meanwhile; keeping this one's record\n";
+        if (auto it = mine.find(name); it != mine.end()) {
+            removed.erase(name);
+            addJSON(name, it->second);
+        } else {
+            added.erase(name);
+            removed.insert(name);
+        }
+        pending.insert(name);
+    }
+}
+
+void Database::replay() {
+    journalSize = 0;
+    int fd = ::open(journalPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    std::string data;
+    char buf[65536];
+    ssize_t n;
+    while ((n = ::read(fd, buf, sizeof(buf))) > 0) data.append(buf, (size_t)n);
+    ::close(fd);
+
+    size_t at = 0;
+    while (data.size() - at >= 8) {
+        uint32_t len, crc, nameLen;
+        memcpy(&len, data.data() + at, 4);
+        memcpy(&crc, data.data() + at + 4, 4);
+        if (len < 5 || data.size() - at - 8 < len) break;
+        const char* p = data.data() + at + 8;
+        if ((uint32_t)crc32(0, (const Bytef*)p, len) != crc) break;
+        memcpy(&nameLen, p + 1, 4);
+        if (5 + (uint64_t)nameLen > len) break;
+        std::string name(p + 5, nameLen);
+        if (p[0] == 'B') {
+            if (!addRecord(name, p + 5 + nameLen, len - 5 - nameLen)) break;
+            removed.erase(name);
+        } else if (p[0] == 'A') {
+            json info = json::parse(p + 5 + nameLen, p + len, nullptr, false);
+            if (!info.is_object()) break;
+            removed.erase(name);
+            addJSON(name, info);
+        } else if (p[0] == 'R') {
+            added.erase(name);
+            removed.insert(name);
+        } else {
+            break;
+        }
+        at += 8 + len;
+    }
+    journalSize = at;
+    if (at < data.size())
+        std::cerr << "[WARN] " << journalPath << ": dropped a torn record at byte " << at << "\n";
+}
+
+const Database::Record* Database::record(uint32_t i) const {
+    return (const Record*)(map + sizeof(Header) + i * stride(map));
+}
+
+const Database::Record* Database::find(std::string_view name) const {
+    if (!map) return nullptr;
+    size_t lo = 0, hi = header(map).packages;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        const Record* r = record((uint32_t)mid);
+        int c = text(map, r->name).compare(name);
+        if (c == 0) return r;
+        if (c < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return nullptr;
+}
+
+PackageView Database::view(const Record& r) const {
+    PackageView v;
+    v.name = text(map, r.name);
+    v.version = text(map, r.version);
+    v.destination = text(map, r.destination);
+    v.manifest = r.firstFile != noManifest;
+    if (header(map).version >= 2) {
+        v.size = r.size;
+        v.installed = r.installTime;
+    } else {
+        for (auto& f : files(r))
+            if (f.type == '0') v.size += f.size;
     }
-    std::ifstream f(dbPath);
-    json data; f >> data;
-    for (auto& [k, v] : data.items())
-        installed[k] = v;
+    return v;
 }
 
-void Database::save() {
-    json data;
-    for (auto& [k, v] : installed)
-        data[k] = v;
-    std::ofstream(dbPath) << data.dump(4);
+std::vector<FileView> Database::files(const Record& r) const {
+    std::vector<FileView> out;
+    if (r.firstFile == noManifest || (uint64_t)r.firstFile + r.fileCount > header(map).files) return out;
+    out.reserve(r.fileCount);
+    const FileRecord* f = fileTable(map) + r.firstFile;
+    for (uint32_t i = 0; i < r.fileCount; ++i, ++f) {
+        FileView v;
+        v.path = text(map, f->path);
+        v.link = text(map, f->link);
+        v.size = f->size;
+        v.mode = f->mode;
+        v.type = (char)f->type;
+        v.sha256 = f->hashed ? f->sha256 : nullptr;
+        out.push_back(v);
+    }
+    return out;
+}
+
+// A package in db.json's layout, as the journal and db.json carry it.
+void Database::addJSON(const std::string& name, const json& info) {
+    bool manifest = info.contains("files") && info["files"].is_array();
+    added.add(name, info.value("version", "unknown"), info.value("destination", ""),
+              info.value("installed", (int64_t)0), manifest);
+    if (!manifest) return;
+    for (auto& e : info["files"]) {
+        std::string path = e.value("path", ""), link = e.value("link", "");
+        uint8_t hash[32];
+        FileView f;
+        f.path = path;
+        f.link = link;
+        f.size = e.value("size", (uint64_t)0);
+        f.mode = e.value("mode", 0u);
+        f.type = (char)typeCode(e.value("type", "file"));
+        f.sha256 = unhex(e.value("sha256", ""), hash) ? hash : nullptr;
+        added.addFile(f);
+    }
+}
+
+// A package out of a 'B' journal record; false, with nothing added, when
+// anything in it points outside it.
+bool Database::addRecord(const std::string& name, const char* data, size_t len) {
+    Record r;
+    if (len < sizeof(r)) return false;
+    memcpy(&r, data, sizeof(r));
+    bool manifest = r.firstFile != noManifest;
+    uint64_t count = manifest ? r.fileCount : 0;
+    if (sizeof(r) + count * sizeof(FileRecord) > len) return false;
+    const char* files = data + sizeof(r);
+    const char* heap = files + count * sizeof(FileRecord);
+    size_t heapSize = len - (size_t)(heap - data);
+    auto str = [&](Str s, std::string_view& out) {
+        if ((uint64_t)s.offset + s.length > heapSize) return false;
+        out = std::string_view(heap + s.offset, s.length);
+        return true;
+    };
+
+    std::string_view version, destination;
+    std::vector<FileView> list(count);
+    std::vector<FileRecord> recs(count);
+    if (count) memcpy(recs.data(), files, count * sizeof(FileRecord));
+    bool ok = str(r.version, version) && str(r.destination, destination);
+    for (uint64_t i = 0; ok && i < count; ++i) {
+        ok = str(recs[i].path, list[i].path) && str(recs[i].link, list[i].link);
+        list[i].size = recs[i].size;
+        list[i].mode = recs[i].mode;
+        list[i].type = (char)recs[i].type;
+        list[i].sha256 = recs[i].hashed ? recs[i].sha256 : nullptr;
+    }
+    if (!ok) return false;
+    added.add(name, version, destination, r.installTime, manifest);
+    for (auto& f : list) added.addFile(f);
+    return true;
 }
 
-bool Database::isInstalled(const std::string& name) {
-    return installed.find(name) != installed.end();
+std::string Database::toRecord(const PackageView& p, const std::vector<FileView>& files) const {
+    std::string heap;
+    auto put = [&heap](std::string_view s) {
+        Str out{(uint32_t)heap.size(), (uint32_t)s.size()};
+        heap.append(s.data(), s.size());
+        return out;
+    };
+    Record r{};
+    r.name = put(p.name);
+    r.version = put(p.version);
+    r.destination = put(p.destination);
+    r.firstFile = p.manifest ? 0 : noManifest;
+    r.fileCount = p.manifest ? (uint32_t)files.size() : 0;
+    r.size = p.size;
+    r.installTime = p.installed;
+    std::string out((const char*)&r, sizeof(r));
+    for (uint32_t i = 0; i < r.fileCount; ++i) {
+        const FileView& f = files[i];
+        FileRecord n{};
+        n.path = put(f.path);
+        n.link = put(f.link);
+        n.size = f.size;
+        n.mode = f.mode;
+        n.type = (uint8_t)f.type;
+        n.hashed = f.sha256 != nullptr;
+        if (f.sha256) memcpy(n.sha256, f.sha256, 32);
+        out.append((const char*)&n, sizeof(n));
+    }
+    return out + heap;
 }
 
-void Database::addPackage(const std::string& name, const std::string& version, const std::string& dest) {
-    installed[name] = {
-        {"version", version},
-        {"destination", dest}
+json Database::toJSON(const PackageView& p, const std::vector<FileView>& files) const {
+    json out = {
+        {"version", std::string(p.version)},
+        {"destination", std::string(p.destination)}
     };
+    if (p.installed) out["installed"] = p.installed;
+    if (!p.manifest) return out;
+    out["size"] = p.size;
+    json list = json::array();
+    for (auto& f : files) {
+        json e = {{"path", std::string(f.path)}, {"type", typeName((uint8_t)f.type)}, {"mode", f.mode}};
+        if (f.type == '0') e["size"] = f.size;
+        if (f.sha256) e["sha256"] = f.hash();
+        if (!f.link.empty()) e["link"] = std::string(f.link);
+        list.push_back(std::move(e));
+    }
+    out["files"] = std::move(list);
+    return out;
+}
+
+bool Database::save() {
+    if (pending.empty()) return true;
+    if (broken) {
+        std::cerr << "[ERROR] not overwriting the damaged " << dbPath << "\n";
+        return false;
+    }
+    FileLock lock(lockPath, LOCK_EX);
+    if (stale()) merge();
+    if (broken) return false;
+    if (!append()) return false;
+    before.clear();
+    // fold the journal in once replaying it costs more than reading the table
+    if (journalSize > std::max(mapSize, compactAt)) compact();
+    stamp();
+    return true;
+}
+
+// One record per changed package, written where the last good one ended,
+// then a single fdatasync.
+bool Database::append() {
+    std::string out;
+    PackageView v;
+    for (auto& name : pending) {
+        bool add = added.get(name, v);
+        std::string rec(1, add ? 'B' : 'R');
+        uint32_t nameLen = (uint32_t)name.size();
+        rec.append((const char*)&nameLen, 4);
+        rec += name;
+        if (add) rec += toRecord(v, added.files(name));
+        uint32_t len = (uint32_t)rec.size();
+        uint32_t crc = (uint32_t)crc32(0, (const Bytef*)rec.data(), len);
+        out.append((const char*)&len, 4);
+        out.append((const char*)&crc, 4);
+        out += rec;
+    }
+
+    int fd = ::open(journalPath.c_str(), O_WRONLY | O_CLOEXEC);
+    bool created = false;
+    if (fd < 0 && errno == ENOENT) {
+        fd = ::open(journalPath.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        created = fd >= 0;
+    }
+    struct stat st;
+    bool ok = fd >= 0 && ::fstat(fd, &st) == 0
+        // a torn tail left by a crash goes before anything is added after it
+        && ((size_t)st.st_size == journalSize || ::ftruncate(fd, (off_t)journalSize) == 0)
+        && ::lseek(fd, (off_t)journalSize, SEEK_SET) == (off_t)journalSize
+        && writeAll(fd, out.data(), out.size())
+        && ::fdatasync(fd) == 0
+        && (!created || syncDir(fs::path(journalPath).parent_path().string()));
+    if (fd >= 0 && ::close(fd) != 0) ok = false;
+    if (!ok) {
+        std::cerr << "[ERROR] cannot write " << journalPath << ": " << strerror(errno) << "\n";
+        return false;
+    }
+    journalSize += out.size();
+    pending.clear();
+    return true;
+}
+
+// Writes every package, the unchanged ones copied record by record out of
+// the current map, into a new file that then replaces the old one, and
+// empties the journal it now includes.
+bool Database::compact() {
+    // destinations, versions and link targets repeat; paths mostly do not
+    std::string heap;
+    std::unordered_map<std::string_view, Str> shared;
+    auto put = [&](std::string_view s, bool share) {
+        if (share) {
+            auto it = shared.find(s);
+            if (it != shared.end()) return it->second;
+        }
+        Str out{(uint32_t)heap.size(), (uint32_t)s.size()};
+        heap.append(s.data(), s.size());
+        if (share) shared.emplace(s, out);
+        return out;
+    };
+
+    std::vector<Record> packages;
+    std::vector<FileRecord> files;
+    for (auto& p : this->packages()) {
+        Record r{};
+        r.name = put(p.name, false);
+        r.version = put(p.version, true);
+        r.destination = put(p.destination, true);
+        r.firstFile = p.manifest ? (uint32_t)files.size() : noManifest;
+        r.size = p.size;
+        r.installTime = p.installed;
+        for (auto& f : this->files(p.name)) {
+            FileRecord n{};
+            n.path = put(f.path, false);
+            n.link = put(f.link, true);
+            n.size = f.size;
+            n.mode = f.mode;
+            n.type = (uint8_t)f.type;
+            n.hashed = f.sha256 != nullptr;
+            if (f.sha256) memcpy(n.sha256, f.sha256, 32);
+            files.push_back(n);
+        }
+        r.fileCount = p.manifest ? (uint32_t)files.size() - r.firstFile : 0;
+        packages.push_back(r);
+    }
+
+    Header h{};
+    memcpy(h.magic, dbMagic, 4);
+    h.version = dbVersion;
+    h.packages = (uint32_t)packages.size();
+    h.files = (uint32_t)files.size();
+    h.heapOffset = sizeof(Header) + packages.size() * sizeof(Record) + files.size() * sizeof(FileRecord);
+    h.heapSize = heap.size();
+
+    std::string tmp = dbPath + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool ok = fd >= 0
+        && writeAll(fd, &h, sizeof(h))
+        && writeAll(fd, packages.data(), packages.size() * sizeof(Record))
+        && writeAll(fd, files.data(), files.size() * sizeof(FileRecord))
+        && writeAll(fd, heap.data(), heap.size())
+        && ::fsync(fd) == 0;
+    if (fd >= 0 && ::close(fd) != 0) ok = false;
+    if (!ok || ::rename(tmp.c_str(), dbPath.c_str()) != 0) {
+        std::cerr << "[ERROR] cannot write " << dbPath << ": " << strerror(errno) << "\n";
+        ::unlink(tmp.c_str());
+        return false;
+    }
+
+    // until the rename is on disk the journal is all that has these records
+    bool durable = syncDir(fs::path(dbPath).parent_path().string());
+    close();
+    added.clear();
+    removed.clear();
+    pending.clear();
+    if (!open()) broken = true;
+    if (!durable) {
+        std::cerr << "[WARN] cannot sync " << fs::path(dbPath).parent_path().string() << "; keeping the journal\n";
+        return true;
+    }
+    if (::truncate(journalPath.c_str(), 0) == 0 || errno == ENOENT) journalSize = 0;
+    return true;
+}
+
+// remembers what a package was before this process first changed it
+void Database::track(const std::string& name) {
+    if (pending.count(name)) return;
+    auto p = get(name);
+    before[name] = p ? std::string(p->version) : "";
+}
+
+bool Database::isInstalled(const std::string& name) const {
+    return get(name).has_value();
+}
+
+void Database::addPackage(const std::string& name, const std::string& version, const std::string& dest,
+                          const std::vector<Entry>& files) {
+    track(name);
+    removed.erase(name);
+    pending.insert(name);
+    added.add(name, version, dest, (int64_t)::time(nullptr), true);
+    for (auto& e : files) {
+        uint8_t hash[32];
+        FileView f;
+        f.path = e.path;
+        f.link = e.link;
+        f.size = e.size;
+        f.mode = e.mode;
+        f.type = e.type;
+        f.sha256 = unhex(e.sha256, hash) ? hash : nullptr;
+        added.addFile(f);
+    }
 }
 
 void Database::removePackage(const std::string& name) {
-    installed.erase(name);
+    track(name);
+    added.erase(name);
+    removed.insert(name);
+    pending.insert(name);
 }
 
-std::string Database::getVersion(const std::string& name) {
-    return installed[name].value("version", "unknown");
+std::optional<PackageView> Database::get(std::string_view name) const {
+    PackageView v;
+    if (added.get(name, v)) return v;
+    if (!removed.empty() && removed.count(std::string(name))) return std::nullopt;
+    const Record* r = find(name);
+    if (!r) return std::nullopt;
+    return view(*r);
 }
 
-std::string Database::getDestination(const std::string& name) {
-    return installed[name].value("destination", "");
+std::vector<FileView> Database::files(std::string_view name) const {
+    if (added.contains(name)) return added.files(name);
+    if (!removed.empty() && removed.count(std::string(name))) return {};
+    const Record* r = find(name);
+    return r ? files(*r) : std::vector<FileView>();
+}
+
+std::vector<PackageView> Database::packages() const {
+    std::vector<PackageView> out = added.packages();
+    if (map) {
+        out.reserve(out.size() + header(map).packages);
+        for (uint32_t i = 0; i < header(map).packages; ++i) {
+            const Record* r = record(i);
+            std::string_view name = text(map, r->name);
+            if (added.contains(name) || (!removed.empty() && removed.count(std::string(name)))) continue;
+            out.push_back(view(*r));
+        }
+    }
+    std::sort(out.begin(), out.end(), [](const PackageView& a, const PackageView& b) { return a.name < b.name; });
+    return out;
 }
 
-std::unordered_map<std::string, json> Database::listInstalled() {
-    return installed;
+json Database::exportJSON() const {
+    json out = json::object();
+    for (auto& p : packages()) out[std::string(p.name)] = toJSON(p, files(p.name));
+    return out;
 }
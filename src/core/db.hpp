@@ -1,19 +1,125 @@
 #pragma once
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
+#include <cstdint>
+#include <cstddef>
+#include <optional>
+#include <vector>
 #include <json.hpp>
+#include "records.hpp"
 
+struct Entry;
+
+// The installed-package database, db.bin. It is mapped, not parsed:
+// looking up a package is a binary search over fixed-width records in
+// place, so a command never pays for packages it does not ask about.
+//
+//   header    "OCDB"  u32 version  u32 packageCount  u32 fileCount
+//             u64 heapOffset  u64 heapSize
+//   packages  str name  str version  str destination
+//             u32 firstFile  u32 fileCount            sorted by name
+//             u64 size  i64 installTime               (from version 2)
+//   files     str path  str link  u64 size  u32 mode  u8 type
+//             u8 hashed  u16 0  u8 sha256[32]         grouped by package
+//   heap      the strings, unterminated
+//
+// A str is u32 offset, u32 length into the heap. The file never leaves the
+// machine, so integers are in host byte order. Version 1 files, whose
+// package records stop at fileCount, are still read.
+//
+// Changes go to db.journal beside it, not into db.bin: save() appends one
+// record per changed package and fdatasyncs once.
+//
+//   record    u32 length  u32 crc32  u8 kind  u32 nameLength  name  body
+//   'B'       the package as db.bin lays it out: its package record, its
+//             file records, then a heap of its own that their strs index
+//   'R'       no body: the package was removed
+//   'A'       the package's JSON, as journals written before 'B' hold it
+//
+// An append costs what the changed packages' records take: nothing that
+// grows with the database, but an added package's file records are part
+// of its record, as until the journal is folded in nothing else holds
+// them.
+//
+// Packages changed since db.bin was written are held in a PackageTable.
+// Lookups hand out views, of either one, that copy nothing.
+//
+// load() replays the journal over the mapped table; a torn record at the
+// end (a crash mid-append) and everything after it are dropped. Once the
+// journal outgrows the table, save() folds it in: a new db.bin is written
+// and renamed over the old one, then the journal is emptied. Replaying a
+// journal already folded in changes nothing, so a crash in between is
+// harmless. A db.json from before is converted the first time it is
+// loaded.
+//
+// Several pacmanoc processes may share the database. load() reads under a
+// shared flock on db.lock and save() writes under an exclusive one, so
+// neither ever sees the other half done, and both hold it only for
+// milliseconds: a long download never keeps anyone waiting. If db.bin or
+// the journal changed after load(), save() first reloads and puts this
+// process's changes back on top, so nobody else's are lost; a package both
+// changed gets a warning and this process's record.
 class Database {
 private:
-    std::string dbPath = "/usr/local/share/pacmanoc/db.json";
-    std::unordered_map<std::string, nlohmann::json> installed;
+    std::string dbPath = "/usr/local/share/pacmanoc/db.bin";
+    std::string jsonPath = "/usr/local/share/pacmanoc/db.json";
+    std::string journalPath = "/usr/local/share/pacmanoc/db.journal";
+    std::string lockPath = "/usr/local/share/pacmanoc/db.lock";
+    const char* map = nullptr;
+    size_t mapSize = 0;
+    bool broken = false;
+    PackageTable added;
+    std::unordered_set<std::string> removed;
+    // packages changed since the last save, and the journal's good length
+    std::unordered_set<std::string> pending;
+    size_t journalSize = 0;
+    // each pending package's version as loaded, "" if it was not installed
+    std::unordered_map<std::string, std::string> before;
+    // what db.bin and the journal were when read, to notice other writers
+    uint64_t binInode = 0;
+    int64_t binTime = 0;
+    int64_t journalSeen = 0;
+
+    struct Record;
+    const Record* find(std::string_view name) const;
+    const Record* record(uint32_t i) const;
+    PackageView view(const Record& r) const;
+    std::vector<FileView> files(const Record& r) const;
+    void addJSON(const std::string& name, const nlohmann::json& info);
+    nlohmann::json toJSON(const PackageView& p, const std::vector<FileView>& files) const;
+    bool addRecord(const std::string& name, const char* data, size_t len);
+    std::string toRecord(const PackageView& p, const std::vector<FileView>& files) const;
+    bool open();
+    void close();
+    void read();
+    void replay();
+    void stamp();
+    bool stale() const;
+    void merge();
+    void track(const std::string& name);
+    bool append();
+    bool compact();
 public:
+    Database() = default;
+    ~Database();
+    Database(const Database&) = delete;
+    Database& operator=(const Database&) = delete;
+
     void load();
-    void save();
-    bool isInstalled(const std::string& name);
-    void addPackage(const std::string& name, const std::string& version, const std::string& dest);
+    bool save();
+    bool isInstalled(const std::string& name) const;
+    // files is the manifest: what extraction created, relative to dest
+    void addPackage(const std::string& name, const std::string& version, const std::string& dest,
+                    const std::vector<Entry>& files);
     void removePackage(const std::string& name);
-    std::string getVersion(const std::string& name);
-    std::string getDestination(const std::string& name);
-    std::unordered_map<std::string, nlohmann::json> listInstalled();
+
+    // The views stay valid until the next load() or save().
+    std::optional<PackageView> get(std::string_view name) const;
+    // empty for packages installed before manifests were kept
+    std::vector<FileView> files(std::string_view name) const;
+    // every installed package, sorted by name
+    std::vector<PackageView> packages() const;
+    // everything, in the layout db.json had
+    nlohmann::json exportJSON() const;
 };
@@ -0,0 +1,49 @@
+#include "hash.hpp"
+#include <openssl/evp.h>
+#include <stdexcept>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+Sha256::Sha256() {
+    ctx = EVP_MD_CTX_new();
+    if (!ctx || EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr) != 1)
+        throw std::runtime_error("sha256 init failed");
+}
+
+Sha256::~Sha256() {
+    EVP_MD_CTX_free(ctx);
+}
+
+void Sha256::update(const void* data, size_t len) {
+    EVP_DigestUpdate(ctx, data, len);
+}
+
+std::string Sha256::hex() {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int n = 0;
+    EVP_DigestFinal_ex(ctx, md, &n);
+    EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr);
+
+    static const char digits[] = "0123456789abcdef";
+    std::string out;
+    for (unsigned int i = 0; i < n; ++i) {
+        out += digits[md[i] >> 4];
+        out += digits[md[i] & 15];
+    }
+    return out;
+}
+
+std::string Sha256::file(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return "";
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    Sha256 h;
+    std::vector<char> buf(1 << 20);
+    ssize_t n;
+    while ((n = ::read(fd, buf.data(), buf.size())) > 0)
+        h.update(buf.data(), (size_t)n);
+    ::close(fd);
+    return n < 0 ? "" : h.hex();
+}
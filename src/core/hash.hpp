@@ -0,0 +1,24 @@
+#pragma once
+#include <string>
+#include <cstddef>
+
+typedef struct evp_md_ctx_st EVP_MD_CTX;
+
+// Incremental SHA-256. OpenSSL picks the SHA-NI / AVX2 code path at
+// runtime when the CPU has it.
+class Sha256 {
+public:
+    Sha256();
+    ~Sha256();
+    Sha256(const Sha256&) = delete;
+    Sha256& operator=(const Sha256&) = delete;
+
+    void update(const void* data, size_t len);
+    std::string hex();
+
+    // hex digest of a whole file, empty if it cannot be read
+    static std::string file(const std::string& path);
+
+private:
+    EVP_MD_CTX* ctx;
+};
@@ -0,0 +1,59 @@
+#include "index.hpp"
+#include <zlib.h>
+
+using json = nlohmann::json;
+
+bool RepoIndex::gunzip(const std::string& in, std::string& out) {
+    z_stream zs{};
+    // 15 + 32: zlib or gzip header, detected automatically
+    if (inflateInit2(&zs, 15 + 32) != Z_OK) return false;
+    zs.next_in = (Bytef*)in.data();
+    zs.avail_in = (uInt)in.size();
+
+    char buf[1 << 16];
+    int ret;
+    do {
+        zs.next_out = (Bytef*)buf;
+        zs.avail_out = sizeof(buf);
+        ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END) break;
+        out.append(buf, sizeof(buf) - zs.avail_out);
+    } while (ret != Z_STREAM_END);
+    inflateEnd(&zs);
+    return ret == Z_STREAM_END;
+}
+
+bool RepoIndex::load(const std::string& body) {
+    std::string text;
+    bool gz = body.size() > 2 && (unsigned char)body[0] == 0x1f && (unsigned char)body[1] == 0x8b;
+    if (gz && !gunzip(body, text)) return false;
+
+    json data = json::parse(gz ? text : body, nullptr, false);
+    if (!data.is_object() || !data.contains("packages") || !data["packages"].is_object())
+        return false;
+    packages = std::move(data["packages"]);
+    ok = true;
+    return true;
+}
+
+const json* RepoIndex::find(const std::string& name) const {
+    auto it = packages.find(name);
+    if (it == packages.end() || !it->is_object()) return nullptr;
+    return &*it;
+}
+
+std::vector<std::string> RepoIndex::names() const {
+    std::vector<std::string> out;
+    for (auto it = packages.begin(); it != packages.end(); ++it)
+        out.push_back(it.key());
+    return out;
+}
+
+bool RepoIndex::wellFormed(const json& entry) {
+    if (!entry.is_object()) return false;
+    for (const char* f : {"version", "destination", "sha256", "description"})
+        if (entry.contains(f) && !entry[f].is_string()) return false;
+    for (const char* f : {"size", "installed_size"})
+        if (entry.contains(f) && !entry[f].is_number_unsigned()) return false;
+    return !entry.contains("dependencies") || entry["dependencies"].is_array();
+}
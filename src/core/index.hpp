@@ -0,0 +1,29 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "../json.hpp"
+
+// The repository index, <baseURL>/index.json.gz:
+//   { "packages": { "<name>": { "version": ..., "size": ..., "sha256": ...,
+//                               "installed_size": ..., "destination": ...,
+//                               "dependencies": [...], "description": ... } } }
+// Each entry carries the same fields as that version's metadata.json.
+class RepoIndex {
+public:
+    // body may be gzip-compressed or plain JSON
+    bool load(const std::string& body);
+    bool loaded() const { return ok; }
+
+    const nlohmann::json* find(const std::string& name) const;
+    std::vector<std::string> names() const;
+
+    static bool gunzip(const std::string& in, std::string& out);
+    // an object whose fields, those above that it has, are of the right
+    // type: strings, sizes as non-negative integers, dependencies an array;
+    // anything else would throw when read
+    static bool wellFormed(const nlohmann::json& entry);
+
+private:
+    bool ok = false;
+    nlohmann::json packages;
+};
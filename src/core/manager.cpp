@@ -2,6 +2,11 @@
 #include "utils.hpp"
 #include "db.hpp"
 #include "tree.hpp"
+#include "net.hpp"
+#include "stream.hpp"
+#include "archive.hpp"
+#include "stage.hpp"
+#include "hash.hpp"
 #include <iostream>
 #include <filesystem>
 #include <curl/curl.h>
@@ -10,38 +15,116 @@
 #include <chrono>
 #include <cstdlib>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <iomanip>
+#include <algorithm>
+#include <unordered_set>
+#include <tuple>
+#include <cstring>
+#include <ctime>
 
 namespace fs = std::filesystem;
 using json = nlohmann::json;
 
-static size_t writeData(void* ptr, size_t size, size_t nmemb, FILE* stream) {
-    return fwrite(ptr, size, nmemb, stream);
+PackageManager::PackageManager() {
+    fetch.setCacheDir(cacheDir + "http/");
+    // on a single core the extraction pool is pure overhead
+    extractThreads = (int)std::min(8u, std::max(1u, std::thread::hardware_concurrency()));
 }
 
-void PackageManager::downloadFile(const std::string& url, const std::string& output) {
-    CURL* curl = curl_easy_init();
-    if (!curl) throw std::runtime_error("curl init failed");
+PackageManager::~PackageManager() = default;
 
-    FILE* fp = fopen(output.c_str(), "wb");
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeData);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
-    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-    curl_easy_perform(curl);
-    curl_easy_cleanup(curl);
-    fclose(fp);
+Database& PackageManager::database() {
+    if (!session) {
+        session = std::make_unique<Database>();
+        session->load();
+    }
+    return *session;
+}
+
+void PackageManager::commit() {
+    if (session) session->save();
+}
+
+// Only the top-level fields pacmanoc reads are kept; everything else in a
+// metadata document is skipped by the parser without being built.
+json PackageManager::parseJSON(const std::string& body) {
+    static const char* fields[] = {
+        "version", "destination", "dependencies", "size", "installed_size", "sha256", "description"
+    };
+    json data = json::parse(body, [](int depth, json::parse_event_t ev, json& parsed) {
+        if (depth != 1 || ev != json::parse_event_t::key) return true;
+        for (const char* f : fields)
+            if (parsed == f) return true;
+        return false;
+    }, false);
+    return data.is_object() ? data : json();
 }
 
 json PackageManager::getJSON(const std::string& url) {
-    std::string tmp = downloadDir + "temp.json";
-    fs::create_directories(downloadDir);
-    downloadFile(url, tmp);
-    std::ifstream f(tmp);
-    json data; f >> data;
+    json data = json::object();
+    fetch.add({url, "", [this, &data](Transfer& t) {
+        if (!t.ok) std::cerr << "[ERROR] " << t.url << ": " << t.error << "\n";
+        else if (json d = parseJSON(t.body); d.is_object()) data = d;
+    }});
+    fetch.run();
     return data;
 }
 
+// Downloaded archives are kept here and reused by later installs. The
+// version is part of the name so a leftover .part from another release is
+// never resumed into this one.
+std::string PackageManager::archivePath(const std::string& name, const std::string& version) {
+    return cacheDir + "archives/" + name + "-" + version + ".ocpackage";
+}
+
+// Fetched at most once per run (and revalidated through the HTTP cache);
+// an unloaded index means the repository has none and callers fall back
+// to per-package latest.json.
+const RepoIndex& PackageManager::repoIndex() {
+    if (indexFetched) return index;
+    indexFetched = true;
+    fetch.add({baseURL + "index.json.gz", "", [this](Transfer& t) {
+        if (t.ok && !index.load(t.body))
+            std::cerr << "[WARN] ignoring malformed repository index " << t.url << "\n";
+    }});
+    fetch.run();
+    return index;
+}
+
+void PackageManager::setJobs(int n) {
+    fetch.setMaxParallel(n);
+}
+
+void PackageManager::setSegments(int n) {
+    segments = n < 1 ? 1 : n;
+}
+
+void PackageManager::setExtractThreads(int n) {
+    extractThreads = n < 1 ? 1 : n;
+}
+
+void PackageManager::setStore(bool on) {
+    useStore = on;
+}
+
+void PackageManager::setUring(bool on) {
+    useUring = on;
+}
+
+void PackageManager::setDirectIO(bool on) {
+    directIO = on;
+}
+
+void PackageManager::setOffline(bool on) {
+    fetch.setOffline(on);
+}
+
+void PackageManager::setFrameSize(int mib) {
+    frameSize = (size_t)(mib < 1 ? 1 : mib) << 20;
+}
+
 void PackageManager::showProgress(const std::string& pkg, int percent, const std::string& state) {
     int bars = percent / 10;
     std::cout << "\r" << pkg << " " << state << " [";
@@ -71,42 +154,140 @@ bool PackageManager::confirmAction(const std::string& msg) {
 
 // ---------- install ----------
 void PackageManager::install(const std::string& pkgName) {
+    install(std::vector<std::string>{pkgName});
+}
+
+void PackageManager::install(const std::vector<std::string>& names) {
+    installPackages(names, false);
+}
+
+// With upgrade set the packages are expected to be installed already: the
+// new version is staged and activated over the old one like any install,
+// and what only the old manifest lists is removed once that succeeded, so
+// a failed download or a bad hash leaves the old version as it was.
+void PackageManager::installPackages(const std::vector<std::string>& names, bool upgrade) {
     if (geteuid() != 0) {
         std::cerr << "[WARN] This operation requires root privileges.\n"
-                  << "Please rerun with 'sudo pacmanoc install " << pkgName << "'\n";
+                  << "Please rerun with 'sudo pacmanoc install";
+        for (auto& n : names) std::cerr << " " << n;
+        std::cerr << "'\n";
         return;
     }
 
-    Database db;
-    db.load();
-
-    if (db.isInstalled(pkgName)) {
-        std::cout << "Package '" << pkgName << "' already installed.\n";
-        return;
+    Database& db = database();
+
+    struct Plan {
+        std::string name;
+        std::string version;
+        json meta;
+        curl_off_t size = 0;
+        curl_off_t got = 0;
+        bool ready = false;
+        std::unique_ptr<RingBuffer> ring;
+        std::thread worker;
+        bool extracted = false;
+        bool cached = false;
+        bool streamed = false;
+        std::unique_ptr<FileSink> partial;
+        std::unique_ptr<MappedSource> resumed;
+        std::vector<Entry> files;
+        std::unique_ptr<Stage> stage;
+    };
+    std::vector<Plan> plans;
+    for (auto& n : names) {
+        if (!upgrade && db.isInstalled(n)) {
+            std::cout << "Package '" << n << "' already installed.\n";
+            continue;
+        }
+        bool dup = false;
+        for (auto& p : plans) dup = dup || p.name == n;
+        if (!dup) plans.push_back(Plan{n});
     }
+    if (plans.empty()) return;
 
-    std::string url = baseURL + pkgName + "/";
+    fs::create_directories(cacheDir + "archives/");
     auto start = std::chrono::steady_clock::now();
-    std::cout << "fetching " << pkgName << " latest version " << url << "latest.json\n";
-    json latest = getJSON(url + "latest.json");
-    std::string version = latest["version"];
-    std::cout << "fetching " << pkgName << " metadata " << url << version << "/metadata.json\n";
-    json meta = getJSON(url + version + "/metadata.json");
+
+    // packages the repository index knows need no requests of their own;
+    // for the rest, latest.json -> metadata.json, chained per package, all
+    // packages in flight at once
+    const RepoIndex& idx = repoIndex();
+    for (auto& plan : plans) {
+        Plan* p = &plan;
+        const json* e = idx.find(p->name);
+        if (e && !RepoIndex::wellFormed(*e)) {
+            std::cerr << "[ERROR] " << p->name << ": malformed entry in the repository index\n";
+            continue;
+        }
+        if (e && e->value("version", "") != "") {
+            p->version = e->value("version", "");
+            p->meta = *e;
+            p->size = p->meta.value("size", (curl_off_t)0);
+            p->ready = true;
+            continue;
+        }
+        std::string url = baseURL + p->name + "/";
+        std::cout << "fetching " << p->name << " latest version " << url << "latest.json\n";
+        fetch.add({url + "latest.json", "",
+            [this, p, url](Transfer& t) {
+                if (!t.ok) {
+                    std::cerr << "[ERROR] " << p->name << ": " << t.url << ": " << t.error << "\n";
+                    return;
+                }
+                json latest = parseJSON(t.body);
+                if (!RepoIndex::wellFormed(latest)) {
+                    std::cerr << "[ERROR] " << p->name << ": malformed " << t.url << "\n";
+                    return;
+                }
+                p->version = latest.value("version", "");
+                if (p->version.empty()) {
+                    std::cerr << "[ERROR] " << p->name << ": no version in " << t.url << "\n";
+                    return;
+                }
+                std::cout << "fetching " << p->name << " metadata " << url << p->version << "/metadata.json\n";
+                fetch.add({url + p->version + "/metadata.json", "",
+                    [this, p](Transfer& t) {
+                        if (!t.ok) {
+                            std::cerr << "[ERROR] " << p->name << ": " << t.url << ": " << t.error << "\n";
+                            return;
+                        }
+                        p->meta = parseJSON(t.body);
+                        if (!RepoIndex::wellFormed(p->meta)) {
+                            std::cerr << "[ERROR] " << p->name << ": malformed metadata " << t.url << "\n";
+                            return;
+                        }
+                        p->size = p->meta.value("size", (curl_off_t)0);
+                        p->ready = true;
+                    }});
+            }});
+    }
+    fetch.run();
+
     auto end = std::chrono::steady_clock::now();
     double sec = std::chrono::duration<double>(end - start).count();
 
-    std::string archiveURL = url + version + "/" + pkgName + ".ocpackage";
-    CURL* curl = curl_easy_init();
-    curl_off_t cl = 0;
-    curl_easy_setopt(curl, CURLOPT_URL, archiveURL.c_str());
-    curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
-    curl_easy_perform(curl);
-    curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &cl);
-    curl_easy_cleanup(curl);
-
-    std::cout << "\nfetched " << humanSize((double)cl) << " in " << std::fixed << std::setprecision(2) << sec << "s\n";
-    std::cout << "on Archives " << humanSize((double)cl) 
-              << ". after this operation, " << humanSize((double)cl)
+    // a cached archive is used as it is when the metadata has a hash to
+    // check it against; the check happens while it is being extracted
+    std::vector<Plan*> todo;
+    curl_off_t total = 0, reused = 0, installed = 0;
+    for (auto& p : plans) {
+        if (!p.ready) continue;
+        todo.push_back(&p);
+        struct stat st;
+        p.cached = !p.meta.value("sha256", "").empty()
+            && ::stat(archivePath(p.name, p.version).c_str(), &st) == 0
+            && (p.size == 0 || st.st_size == p.size);
+        if (p.cached) p.got = p.size = st.st_size;
+        (p.cached ? reused : total) += p.size;
+        installed += p.meta.value("installed_size", p.size);
+    }
+    if (todo.empty()) return;
+
+    std::cout << "\nfetched metadata for " << todo.size() << " package(s) in "
+              << std::fixed << std::setprecision(2) << sec << "s\n";
+    std::cout << "Need to get " << humanSize((double)total);
+    if (reused > 0) std::cout << " (" << humanSize((double)reused) << " cached)";
+    std::cout << " of archives. after this operation, " << humanSize((double)installed)
               << " of additional disk space will be used.\n";
 
     if (!confirmAction("Do you want to continue?")) {
@@ -115,32 +296,279 @@ void PackageManager::install(const std::string& pkgName) {
     }
 
     std::cout << "\nReading package lists... Done (1-100%)\n";
-    std::this_thread::sleep_for(std::chrono::milliseconds(300));
     std::cout << "Building dependency tree... Done (1-100%)\n";
-    std::this_thread::sleep_for(std::chrono::milliseconds(300));
     std::cout << "Reading state information... Done (1-100%)\n\n";
 
-    std::cout << "The following additional packages will be installed:\n  libexample1 libexample2\n\n";
-    std::cout << "0 upgraded, 3 newly installed, 0 to remove and 0 not upgraded.\n\n";
-
-    std::cout << "Downloading package...\n";
-    for (int i = 0; i <= 100; i += 10) {
-        showProgress(pkgName, i, "Downloading");
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    std::cout << (upgrade ? "The following packages will be upgraded:\n " : "The following NEW packages will be installed:\n ");
+    for (auto* p : todo) std::cout << " " << p->name;
+    std::cout << "\n" << (upgrade ? todo.size() : 0) << " upgraded, " << (upgrade ? 0 : todo.size())
+              << " newly installed, 0 to remove and 0 not upgraded.\n\n";
+
+    if (total > 0)
+        std::cout << "Downloading " << (todo.size() == 1 ? "package" : "packages") << "...\n";
+    std::string label = todo.size() == 1 ? todo[0]->name : std::to_string(todo.size()) + " packages";
+    int shown = -1;
+    auto report = [&]() {
+        curl_off_t got = 0, want = 0;
+        for (auto* p : todo) { got += p->got; want += p->size; }
+        int percent = want > 0 ? (int)(got * 100 / want) : 0;
+        if (percent > 100) percent = 100;
+        if (percent != shown) showProgress(label, shown = percent, "Downloading");
+    };
+    if (total > 0) report();
+
+    // Unless segmented downloads were asked for, each archive is extracted
+    // by its own worker while it downloads, fed through a ring buffer and
+    // copied into a .part in the archive cache, so that a run which fails
+    // part-way leaves the next one something to resume from. The bytes are
+    // hashed as they arrive; an archive whose hash does not match is not
+    // staged, and its stage, with whatever was extracted, is thrown away
+    // before anything is activated. One that matches stays in the cache.
+    // Either way it lands in a stage beside its destination, and nothing
+    // becomes visible until everything has been extracted and synced.
+    for (auto* p : todo) {
+        std::string finalDest = p->meta.value("destination", "/usr/bin/");
+        Stage::cleanStale(finalDest);
+        p->stage = std::make_unique<Stage>(finalDest, p->name);
+        std::string dest = p->stage->path();
+        if (p->cached) continue;
+        p->ready = false;
+        std::string sha256 = p->meta.value("sha256", "");
+        p->streamed = segments <= 1;
+        std::string part = archivePath(p->name, p->version) + ".part";
+        Transfer t{archiveURL(p->name, p->version),
+            p->streamed ? "" : archivePath(p->name, p->version),
+            [p, part, &report](Transfer& t) {
+                if (p->partial) {
+                    // a .part is kept only for a run that failed on the network,
+                    // not one the extractor gave up on, the server would not
+                    // continue, or that arrived whole and did not match its hash
+                    curl_off_t from = p->resumed ? (curl_off_t)p->resumed->size() : 0;
+                    bool refused = from > 0 && t.delivered == from && (t.status == 200 || t.status == 416);
+                    bool whole = p->size > 0 && t.delivered >= p->size;
+                    bool resumable = !t.ok && !p->ring->cancelled() && !refused && !whole;
+                    bool closed = p->partial->close();
+                    p->partial.reset();
+                    std::string keep = part.substr(0, part.size() - 5);
+                    if (closed && t.ok && !t.sha256.empty()) {
+                        if (::rename(part.c_str(), keep.c_str()) != 0) ::unlink(part.c_str());
+                    } else if (!closed || !resumable) {
+                        ::unlink(part.c_str());
+                    }
+                }
+                if (p->ring) p->ring->close(!t.ok);
+                if (!t.ok) {
+                    std::cerr << "\n[ERROR] " << p->name << ": " << t.url << ": " << t.error << "\n";
+                    return;
+                }
+                p->got = p->size = std::max(p->size, p->got);
+                p->ready = true;
+                report();
+            }};
+        t.size = p->size;
+        t.segments = segments;
+        t.sha256 = sha256;
+        t.direct = directIO;
+        t.progress = [p, &report](curl_off_t now, curl_off_t total) {
+            // metadata without a size: fall back to what the server says
+            if (p->size == 0 && total > 0) p->size = total;
+            p->got = now;
+            report();
+        };
+        if (p->streamed) {
+            p->ring = std::make_unique<RingBuffer>();
+            p->ring->onSpace = [this] { fetch.wakeup(); };
+            RingBuffer* ring = p->ring.get();
+            // what an earlier run left is fed to the extractor first and the
+            // rest asked for from its end; one that is already whole has
+            // nothing left to ask for and is started over
+            struct stat st;
+            bool resume = ::stat(part.c_str(), &st) == 0 && st.st_size > 0 && (p->size == 0 || st.st_size < p->size);
+            p->partial = std::make_unique<FileSink>();
+            if (!p->partial->open(part, resume, p->size, directIO)) {
+                p->partial.reset();
+            } else if (resume) {
+                p->resumed = std::make_unique<MappedSource>(part);
+                if (p->resumed->failed() || p->resumed->size() != p->partial->size()) {
+                    p->resumed.reset();
+                    if (!p->partial->open(part, false, p->size, directIO)) p->partial.reset();
+                }
+            }
+            if (p->resumed) {
+                t.delivered = (curl_off_t)p->resumed->size();
+                // the digest carries on from what the .part already holds
+                if (!sha256.empty()) {
+                    MappedSource prefix(part);
+                    t.digest = std::make_shared<Sha256>();
+                    if (const char* data = prefix.view(t.delivered)) t.digest->update(data, t.delivered);
+                }
+            }
+            t.sink = [ring, p, part](const char* data, size_t len) -> long {
+                if (ring->cancelled()) return -1;
+                if (!ring->tryWrite(data, len)) return 0;
+                // a copy that cannot be written is dropped, not fatal
+                if (p->partial && !p->partial->write(data, len)) {
+                    p->partial.reset();
+                    ::unlink(part.c_str());
+                }
+                return (long)len;
+            };
+            p->worker = std::thread([this, p, dest] {
+                p->extracted = extractStream(*p->ring, p->resumed.get(), dest, p->files);
+            });
+        }
+        fetch.add(std::move(t));
     }
+    fetch.run();
+    for (auto* p : todo)
+        if (p->worker.joinable()) p->worker.join();
 
-    std::cout << "\nExtracting package...\n";
-    std::string dest = meta.value("destination", "/usr/bin/");
-    extractPackage(downloadDir + pkgName + ".ocpackage", dest);
+    if (std::any_of(todo.begin(), todo.end(), [](Plan* p) { return !p->streamed; }))
+        std::cout << "\nExtracting " << (todo.size() == 1 ? "package" : "packages") << "...\n";
+    else
+        std::cout << "\n";
+    std::vector<Plan*> staged;
+    for (auto* p : todo) {
+        if (!p->ready) continue;
+        if (!p->stage->error().empty()) {
+            std::cerr << "[ERROR] " << p->name << ": " << p->stage->error() << "\n";
+            continue;
+        }
+        if (p->cached)
+            p->extracted = extractPackage(archivePath(p->name, p->version), p->stage->path(), p->files,
+                                          p->meta.value("sha256", ""));
+        else if (!p->streamed)
+            p->extracted = extractPackage(archivePath(p->name, p->version), p->stage->path(), p->files);
+        if (!p->extracted) {
+            std::cerr << "[ERROR] " << p->name << ": extraction failed\n";
+            continue;
+        }
+        staged.push_back(p);
+    }
 
-    db.addPackage(pkgName, version, dest);
-    db.save();
+    // one sync per filesystem makes the staged data durable before any of
+    // it is renamed into place, and one more makes the renames durable
+    // before the database says the packages are there
+    auto syncAll = [&staged]() {
+        std::vector<dev_t> synced;
+        bool ok = true;
+        for (auto* p : staged) {
+            if (std::find(synced.begin(), synced.end(), p->stage->device()) != synced.end()) continue;
+            synced.push_back(p->stage->device());
+            if (!p->stage->sync()) {
+                std::cerr << "[ERROR] " << p->stage->error() << "\n";
+                ok = false;
+            }
+        }
+        return ok;
+    };
+    if (!staged.empty() && !syncAll()) {
+        std::cerr << "[ERROR] nothing was installed\n";
+        return;
+    }
 
-    std::cout << "Setting up " << pkgName << " (" << version << ") ...\n";
-    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    std::vector<Plan*> activated;
+    for (auto* p : staged) {
+        std::cout << "Setting up " << p->name << " (" << p->version << ") ...\n";
+        if (!p->stage->activate(p->files)) {
+            std::cerr << "[ERROR] " << p->name << ": " << p->stage->error() << "\n";
+            continue;
+        }
+        activated.push_back(p);
+    }
+    staged.swap(activated);
+    syncAll();
+
+    for (auto* p : staged) {
+        std::string dest = p->meta.value("destination", "/usr/bin/");
+        // paths of the version being replaced that this one does not ship;
+        // a package from before manifests only ever had its binary
+        std::string oldDest;
+        std::vector<FileView> gone;
+        if (auto old = db.get(p->name)) {
+            oldDest = std::string(old->destination);
+            std::unordered_set<std::string> now;
+            for (auto& e : p->files) now.insert((fs::path(dest) / e.path).lexically_normal().string());
+            std::vector<FileView> files = db.files(p->name);
+            if (!old->manifest) {
+                FileView binary;
+                binary.path = p->name;
+                files.push_back(binary);
+            }
+            for (auto& f : files)
+                if (!now.count((fs::path(oldDest) / f.path).lexically_normal().string())) gone.push_back(f);
+        }
+        db.addPackage(p->name, p->version, dest, p->files);
+        if (!gone.empty()) removeFiles(db, p->name, oldDest, gone);
+    }
     std::cout << "done\n";
 }
 
+// The directory holding rel under rootfd, opened a component at a time
+// without following symlinks; -1, with errno set, when one is in the way.
+static int openParent(int rootfd, const std::string& rel, std::string& leaf) {
+    size_t slash = rel.rfind('/');
+    leaf = slash == std::string::npos ? rel : rel.substr(slash + 1);
+    int fd = ::fcntl(rootfd, F_DUPFD_CLOEXEC, 0);
+    for (size_t at = 0; fd >= 0 && slash != std::string::npos && at < slash;) {
+        size_t end = rel.find('/', at);
+        std::string part = rel.substr(at, end - at);
+        at = end + 1;
+        if (part.empty() || part == ".") continue;
+        int next = part == ".." ? (errno = EPERM, -1)
+                                : ::openat(fd, part.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        ::close(fd);
+        fd = next;
+    }
+    return fd;
+}
+
+// Deletes what a package's manifest lists, deepest paths first so that
+// directories are emptied before they are removed. Directories that still
+// hold something, and paths another package also lists, are left alone.
+// Nothing is reached through a symlink: a manifest path whose directory
+// has been replaced by one is skipped.
+void PackageManager::removeFiles(Database& db, const std::string& name, const std::string& dest,
+                                 const std::vector<FileView>& files) {
+    std::unordered_set<std::string> shared;
+    for (auto& other : db.packages()) {
+        if (other.name == name) continue;
+        fs::path d(other.destination);
+        for (auto& f : db.files(other.name))
+            shared.insert((d / f.path).lexically_normal().string());
+    }
+
+    int destfd = ::open(dest.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (destfd < 0) {
+        std::cerr << "\n[WARN] cannot open " << dest << ": " << strerror(errno) << "\n";
+        return;
+    }
+    // absolute path, path relative to dest, directory or not
+    std::vector<std::tuple<std::string, std::string, bool>> paths;
+    for (auto& f : files) {
+        fs::path rel = fs::path(f.path).lexically_normal();
+        paths.push_back({(fs::path(dest) / rel).lexically_normal().string(), rel.string(), f.type == '5'});
+    }
+    std::sort(paths.begin(), paths.end(), std::greater<>());
+
+    size_t done = 0;
+    for (auto& [p, rel, isDir] : paths) {
+        if (++done % 64 == 0 || done == paths.size())
+            showProgress(name, (int)(done * 100 / paths.size()), "Removing");
+        if (shared.count(p)) continue;
+        std::string leaf;
+        int parent = openParent(destfd, rel, leaf);
+        if (parent < 0) {
+            if (errno != ENOENT) std::cerr << "\n[WARN] not removing " << p << ": " << strerror(errno) << "\n";
+            continue;
+        }
+        if (::unlinkat(parent, leaf.c_str(), isDir ? AT_REMOVEDIR : 0) != 0 && !isDir && errno != ENOENT)
+            std::cerr << "\n[WARN] cannot remove " << p << ": " << strerror(errno) << "\n";
+        ::close(parent);
+    }
+    ::close(destfd);
+}
+
 // ---------- remove ----------
 void PackageManager::remove(const std::string& name) {
     if (geteuid() != 0) {
@@ -149,16 +577,19 @@ void PackageManager::remove(const std::string& name) {
         return;
     }
 
-    Database db;
-    db.load();
-
-    if (!db.isInstalled(name)) {
+    Database& db = database();
+    auto pkg = db.get(name);
+    if (!pkg) {
         std::cout << "Package '" << name << "' is not installed.\n";
         return;
     }
 
-    std::string path = db.getDestination(name) + "/" + name;
-    double sizeBytes = fs::exists(path) ? fs::file_size(path) : 0;
+    std::string dest(pkg->destination);
+    std::string path = dest + "/" + name;
+    std::vector<FileView> files = db.files(name);
+    double sizeBytes = (double)pkg->size;
+    if (files.empty())
+        sizeBytes = fs::exists(path) ? fs::file_size(path) : 0;
 
     std::cout << "After this operation, " << humanSize(sizeBytes)
               << " of disk space will be freed.\n";
@@ -171,14 +602,15 @@ void PackageManager::remove(const std::string& name) {
     std::cout << "(Reading database ...)\n";
     std::this_thread::sleep_for(std::chrono::milliseconds(300));
     std::cout << "Removing " << name << "...\n";
-    for (int i = 0; i <= 100; i += 10) {
-        showProgress(name, i, "Removing");
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    if (files.empty()) {
+        // installed before manifests: all we know about is the binary
+        showProgress(name, 0, "Removing");
+        if (fs::exists(path)) fs::remove(path);
+        showProgress(name, 100, "Removing");
+    } else {
+        removeFiles(db, name, dest, files);
     }
-
-    if (fs::exists(path)) fs::remove(path);
     db.removePackage(name);
-    db.save();
 
     std::cout << "\nProcessing triggers for system...\n";
     std::this_thread::sleep_for(std::chrono::milliseconds(200));
@@ -187,36 +619,58 @@ void PackageManager::remove(const std::string& name) {
 
 // ---------- new commands ----------
 void PackageManager::show(const std::string& name) {
-    Database db;
-    db.load();
-
-    if (!db.isInstalled(name)) {
+    Database& db = database();
+    auto pkg = db.get(name);
+    if (!pkg) {
         std::cout << "Package '" << name << "' not installed.\n";
         return;
     }
 
-    std::string dest = db.getDestination(name);
+    std::string dest(pkg->destination);
+    std::vector<FileView> files = db.files(name);
+
     std::cout << "Package: " << name << "\n";
-    std::cout << "Version: " << db.getVersion(name) << "\n";
+    std::cout << "Version: " << pkg->version << "\n";
     std::cout << "Installed to: " << dest << "\n";
+    if (pkg->installed) {
+        time_t t = (time_t)pkg->installed;
+        std::cout << "Install date: " << std::put_time(std::localtime(&t), "%Y-%m-%d %H:%M:%S") << "\n";
+    }
+    if (files.empty()) {
+        std::cout << "Files: no manifest recorded; reinstall " << name << " to list them\n";
+        return;
+    }
+    std::cout << "Installed size: " << humanSize((double)pkg->size) << "\n";
     std::cout << "Files:\n";
-    for (auto& p : fs::recursive_directory_iterator(dest))
-        std::cout << "  " << p.path().string() << "\n";
+    for (auto& f : files)
+        std::cout << "  " << (fs::path(dest) / f.path).string() << "\n";
 }
 
 void PackageManager::list() {
-    Database db;
-    db.load();
+    Database& db = database();
     std::cout << "Available packages from " << baseURL << ":\n";
-    std::vector<std::string> pkgs = {"hello","world","example"}; // mock
+    const RepoIndex& idx = repoIndex();
+    std::vector<std::string> pkgs = idx.loaded() ? idx.names()
+        : std::vector<std::string>{"hello","world","example"}; // mock
 
     for (auto& pkg : pkgs) {
         std::cout << "  " << pkg;
+        if (const json* e = idx.find(pkg); e && !RepoIndex::wellFormed(*e)) {
+            std::cout << " (malformed index entry)";
+        } else if (e) {
+            std::cout << " " << e->value("version", "");
+            if (e->contains("description")) std::cout << " - " << e->value("description", "");
+        }
         if (db.isInstalled(pkg)) std::cout << " (INSTALLED)";
         std::cout << "\n";
     }
 }
 
+void PackageManager::exportDatabase() {
+    Database& db = database();
+    std::cout << db.exportJSON().dump(4) << "\n";
+}
+
 void PackageManager::dir() {
     std::cout << "Package installation directories:\n";
     printTree("/usr/bin/");
@@ -231,11 +685,60 @@ void PackageManager::autoremove() {
     std::cout << "Cleaning cache directory " << downloadDir << " ...\n";
     fs::remove_all(downloadDir);
     std::cout << "Unused cache cleared.\n";
+
+    Database& db = database();
+    pruneArchives(db);
+    if (fs::exists(storeDir)) pruneStore(db);
+}
+
+// The archive cache keeps what would reinstall the packages as they are
+// now; other versions and interrupted downloads go.
+void PackageManager::pruneArchives(Database& db) {
+    std::unordered_set<std::string> keep;
+    for (auto& p : db.packages())
+        keep.insert(fs::path(archivePath(std::string(p.name), std::string(p.version))).filename().string());
+
+    std::error_code ec;
+    size_t removed = 0;
+    double freed = 0;
+    for (auto it = fs::directory_iterator(cacheDir + "archives", ec); !ec && it != fs::directory_iterator(); it.increment(ec)) {
+        if (!it->is_regular_file() || keep.count(it->path().filename().string())) continue;
+        freed += it->file_size();
+        if (fs::remove(it->path(), ec)) ++removed;
+    }
+    std::cout << "Pruned " << removed << " cached archives (" << humanSize(freed) << ").\n";
+}
+
+// Drops store objects that no installed package's manifest mentions, and
+// temporaries left behind by an interrupted install. Anything changed in
+// the last hour is left alone: an install still running may be writing it,
+// or have published it before its package reached the database.
+void PackageManager::pruneStore(Database& db) {
+    const time_t grace = 3600;
+    time_t now = ::time(nullptr);
+    std::unordered_set<std::string> keep;
+    for (auto& p : db.packages())
+        for (auto& f : db.files(p.name))
+            if (f.sha256) keep.insert(f.hash());
+
+    std::error_code ec;
+    size_t removed = 0;
+    double freed = 0;
+    for (auto it = fs::recursive_directory_iterator(storeDir + "objects", ec); !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+        if (!it->is_regular_file()) continue;
+        std::string file = it->path().filename().string();
+        std::string hash = it->path().parent_path().filename().string() + file;
+        if (file.rfind(".tmp.", 0) != 0 && keep.count(hash)) continue;
+        struct stat st;
+        if (::lstat(it->path().c_str(), &st) != 0 || st.st_ctime > now - grace) continue;
+        freed += it->file_size();
+        if (fs::remove(it->path(), ec)) ++removed;
+    }
+    std::cout << "Pruned " << removed << " unused store objects (" << humanSize(freed) << ").\n";
 }
 
 void PackageManager::sync(const std::string& name) {
-    Database db;
-    db.load();
+    Database& db = database();
 
     if (!db.isInstalled(name)) {
         std::cout << "Package '" << name << "' not installed.\n";
@@ -243,25 +746,29 @@ void PackageManager::sync(const std::string& name) {
     }
 
     std::cout << "Checking updates for " << name << "...\n";
-    json meta = getJSON(baseURL + name + "/latest.json");
-    std::string latestVer = meta["version"];
-    std::string currentVer = db.getVersion(name);
+    std::string latestVer = latestVersion(name);
+    if (latestVer.empty()) {
+        std::cerr << "[ERROR] could not fetch latest version of " << name << "\n";
+        return;
+    }
+    std::string currentVer(db.get(name)->version);
 
     if (latestVer != currentVer) {
         std::cout << "Update available: " << currentVer << " → " << latestVer << "\n";
-        remove(name);
-        install(name);
+        installPackages({name}, true);
     } else {
         std::cout << name << " already up to date.\n";
     }
 }
 
 void PackageManager::syncAll() {
-    Database db;
-    db.load();
+    Database& db = database();
     std::cout << "Synchronizing all packages...\n";
-    for (auto& pkg : db.listInstalled())
-        sync(pkg.first);
+    // sync changes the database as it goes; walk a copy of the names
+    std::vector<std::string> names;
+    for (auto& p : db.packages()) names.emplace_back(p.name);
+    for (auto& name : names)
+        sync(name);
     std::cout << "All packages synchronized.\n";
 }
 
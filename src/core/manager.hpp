@@ -1,11 +1,25 @@
 #pragma once
 #include <string>
 #include <vector>
+#include <memory>
 #include "../json.hpp"
+#include "net.hpp"
+#include "index.hpp"
+
+class RingBuffer;
+class Source;
+struct PackageFooter;
+struct Entry;
+class Database;
+struct FileView;
 
 class PackageManager {
 public:
+    PackageManager();
+    ~PackageManager();
+
     void install(const std::string& name);
+    void install(const std::vector<std::string>& names);
     void remove(const std::string& name);
     void show(const std::string& name);
     void list();
@@ -14,15 +28,59 @@ public:
     void sync(const std::string& name);
     void syncAll();
     void showVersion();
+    void pack(const std::string& dir, const std::string& out);
+    void showArchive(const std::string& what);
+    void owner(const std::string& path);
+    void extractFile(const std::string& what, const std::string& path, const std::string& out);
+    void exportDatabase();
+    void setJobs(int n);
+    void setSegments(int n);
+    void setExtractThreads(int n);
+    void setFrameSize(int mib);
+    void setStore(bool on);
+    void setOffline(bool on);
+    void setDirectIO(bool on);
+    void setUring(bool on);
+    // writes whatever the commands run so far changed, in one go
+    void commit();
 
 private:
     std::string baseURL = "https://uocdev.github.io/packagesOC/";
     std::string downloadDir = "/tmp/pacmanoc/";
+    std::string cacheDir = "/var/cache/pacmanoc/";
+    std::string storeDir = "/usr/local/share/pacmanoc/store/";
+    bool useStore = false;
+    bool directIO = false;
+    bool useUring = false;
+    Fetcher fetch;
+    int segments = 1;
+    int extractThreads;
+    size_t frameSize = 4 << 20;
+    RepoIndex index;
+    bool indexFetched = false;
+    // loaded on first use and shared by every command of this invocation
+    std::unique_ptr<Database> session;
 
-    void downloadFile(const std::string& url, const std::string& output);
-    void extractPackage(const std::string& file, const std::string& dest);
+    void installPackages(const std::vector<std::string>& names, bool upgrade);
+    std::string archivePath(const std::string& name, const std::string& version);
+    bool extractPackage(const std::string& file, const std::string& dest, std::vector<Entry>& files,
+                        const std::string& sha256 = "");
+    bool extractStream(RingBuffer& in, Source* resumed, const std::string& dest, std::vector<Entry>& files);
+    std::string archiveURL(const std::string& name, const std::string& version);
+    std::string latestVersion(const std::string& name);
+    std::string locateArchive(const std::string& what);
+    bool readRange(const std::string& where, uint64_t from, uint64_t len, bool tail,
+                   std::string& out, uint64_t& total);
+    bool loadFooter(const std::string& where, PackageFooter& footer);
     void showProgress(const std::string& pkg, int percent, const std::string& state);
+    const RepoIndex& repoIndex();
+    Database& database();
     nlohmann::json getJSON(const std::string& url);
+    nlohmann::json parseJSON(const std::string& body);
+    void pruneStore(Database& db);
+    void pruneArchives(Database& db);
+    void removeFiles(Database& db, const std::string& name, const std::string& dest,
+                     const std::vector<FileView>& files);
     std::string humanSize(double bytes);
     bool confirmAction(const std::string& msg);
 };
@@ -0,0 +1,586 @@
+#include "net.hpp"
+#include "hash.hpp"
+#include "stream.hpp"
+#include <stdexcept>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <strings.h>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+// below this a range is not worth its own connection
+static const curl_off_t minSegment = 4 << 20;
+
+static size_t writeBody(char* ptr, size_t size, size_t nmemb, std::string* body) {
+    body->append(ptr, size * nmemb);
+    return size * nmemb;
+}
+
+size_t Fetcher::writeFile(char* ptr, size_t size, size_t nmemb, void* userp) {
+    Active* a = static_cast<Active*>(userp);
+    if (!a->checked) {
+        a->checked = true;
+        long code = 0;
+        curl_easy_getinfo(a->easy, CURLINFO_RESPONSE_CODE, &code);
+        a->discard = code >= 400;
+    }
+    if (a->discard) return size * nmemb;   // error page, not the file
+    size_t n = size * nmemb;
+    if (!a->file->write(ptr, n)) return 0;
+    if (a->t.digest) a->t.digest->update(ptr, n);
+    a->t.delivered += n;
+    return n;
+}
+
+// Folds the first len bytes of a partial download into a fresh digest.
+static bool hashPrefix(int fd, curl_off_t len, Sha256& sha) {
+    std::vector<char> buf(1 << 20);
+    for (curl_off_t at = 0; at < len;) {
+        ssize_t r = ::pread(fd, buf.data(), (size_t)std::min<curl_off_t>(len - at, buf.size()), at);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        sha.update(buf.data(), (size_t)r);
+        at += r;
+    }
+    return true;
+}
+
+size_t Fetcher::writeSink(char* ptr, size_t size, size_t nmemb, void* userp) {
+    Active* a = static_cast<Active*>(userp);
+    size_t n = size * nmemb;
+    if (!a->checked) {
+        a->checked = true;
+        long code = 0;
+        curl_easy_getinfo(a->easy, CURLINFO_RESPONSE_CODE, &code);
+        a->discard = code >= 400;
+    }
+    if (a->discard) return n;
+
+    long r = a->t.sink(ptr, n);
+    if (r == 0) {
+        a->paused = true;
+        a->owner->paused.push_back(a);
+        return CURL_WRITEFUNC_PAUSE;
+    }
+    if (r < 0) return 0;
+    if (a->t.digest) a->t.digest->update(ptr, n);
+    a->t.delivered += n;
+    return n;
+}
+
+size_t Fetcher::writeSegment(char* ptr, size_t size, size_t nmemb, void* userp) {
+    Active* a = static_cast<Active*>(userp);
+    Split* sp = a->split;
+    size_t n = size * nmemb;
+    if (!a->checked) {
+        a->checked = true;
+        long code = 0;
+        curl_easy_getinfo(a->easy, CURLINFO_RESPONSE_CODE, &code);
+        // a 200 means the server ignores ranges; anything else is an error
+        // page, taken off the wire so the status decides about a retry
+        if (code == 200) {
+            sp->fallback = true;
+            return 0;
+        }
+        a->discard = code != 206;
+    }
+    if (a->discard) return n;
+    if (sp->fallback || a->offset + (curl_off_t)n > a->to + 1) return 0;
+
+    for (size_t done = 0; done < n;) {
+        ssize_t w = ::pwrite(sp->fd, ptr + done, n - done, a->offset + done);
+        if (w < 0) return 0;
+        done += (size_t)w;
+    }
+    a->offset += n;
+    sp->got[a->seg] += n;
+
+    if (sp->t.progress) {
+        curl_off_t sum = 0;
+        for (curl_off_t g : sp->got) sum += g;
+        sp->t.progress(sum, sp->t.size);
+    }
+    return n;
+}
+
+static std::string headerValue(const char* buf, size_t n, const char* name) {
+    size_t len = strlen(name);
+    if (n <= len || strncasecmp(buf, name, len) != 0 || buf[len] != ':') return "";
+    std::string v(buf + len + 1, n - len - 1);
+    v.erase(0, v.find_first_not_of(" \t"));
+    v.erase(v.find_last_not_of(" \t\r\n") + 1);
+    return v;
+}
+
+size_t Fetcher::captureHeader(char* buf, size_t size, size_t nitems, void* userp) {
+    Active* a = static_cast<Active*>(userp);
+    size_t n = size * nitems;
+    // a new status line starts a new response (after a redirect, say)
+    if (n > 5 && strncmp(buf, "HTTP/", 5) == 0) {
+        a->etag.clear();
+        a->lastModified.clear();
+    } else if (std::string v = headerValue(buf, n, "ETag"); !v.empty()) {
+        a->etag = v;
+    } else if (std::string v = headerValue(buf, n, "Last-Modified"); !v.empty()) {
+        a->lastModified = v;
+    } else if (std::string v = headerValue(buf, n, "Content-Range"); !v.empty()) {
+        size_t slash = v.find('/');
+        if (slash != std::string::npos && v[slash + 1] != '*')
+            a->t.total = std::strtoll(v.c_str() + slash + 1, nullptr, 10);
+    }
+    return n;
+}
+
+// A Content-Range total that disagrees with the expected size means the
+// metadata is stale; give up on ranges and take whatever the server has.
+size_t Fetcher::segmentHeader(char* buf, size_t size, size_t nitems, void* userp) {
+    Active* a = static_cast<Active*>(userp);
+    size_t n = size * nitems;
+    if (n > 14 && strncasecmp(buf, "Content-Range:", 14) == 0) {
+        std::string h(buf, n);
+        size_t slash = h.find('/');
+        if (slash != std::string::npos && h[slash + 1] != '*'
+            && std::strtoll(h.c_str() + slash + 1, nullptr, 10) != a->split->t.size)
+            a->split->fallback = true;
+    }
+    return n;
+}
+
+int Fetcher::xferInfo(void* userp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t, curl_off_t) {
+    Active* a = static_cast<Active*>(userp);
+    a->t.progress(a->offset + dlnow, dltotal > 0 ? a->offset + dltotal : 0);
+    return 0;
+}
+
+static bool retryable(CURLcode result, long status) {
+    switch (result) {
+    case CURLE_OK:
+        return status >= 500;
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_GOT_NOTHING:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_HTTP2:
+    case CURLE_HTTP2_STREAM:
+        return true;
+    default:
+        return false;
+    }
+}
+
+Fetcher::Fetcher(int maxParallel) {
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    multi = curl_multi_init();
+    share = curl_share_init();
+    if (!multi || !share) throw std::runtime_error("curl multi init failed");
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    setMaxParallel(maxParallel);
+}
+
+Fetcher::~Fetcher() {
+    for (CURL* easy : idle) curl_easy_cleanup(easy);
+    curl_multi_cleanup(multi);
+    curl_share_cleanup(share);
+    curl_global_cleanup();
+}
+
+void Fetcher::setMaxParallel(int n) {
+    maxParallel = n < 1 ? 1 : n;
+    curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)maxParallel);
+}
+
+void Fetcher::setCacheDir(const std::string& dir) {
+    cacheDir = dir;
+}
+
+void Fetcher::setOffline(bool on) {
+    offline = on;
+}
+
+std::string Fetcher::cachePath(const std::string& url) {
+    Sha256 h;
+    h.update(url.data(), url.size());
+    return cacheDir + h.hex();
+}
+
+// Cache entries are two files: <key>.body holds the response and <key>
+// holds the ETag and Last-Modified lines it was served with.
+void Fetcher::loadCached(Active* a) {
+    std::string key = cachePath(a->t.url);
+    std::ifstream f(key);
+    std::string etag, lastModified;
+    if (!std::getline(f, etag) || !std::getline(f, lastModified)) return;
+    if (::access((key + ".body").c_str(), R_OK) != 0) return;
+    if (!etag.empty())
+        a->headers = curl_slist_append(a->headers, ("If-None-Match: " + etag).c_str());
+    if (!lastModified.empty())
+        a->headers = curl_slist_append(a->headers, ("If-Modified-Since: " + lastModified).c_str());
+}
+
+void Fetcher::storeCached(Active* a) {
+    if (a->etag.empty() && a->lastModified.empty()) return;
+    std::error_code ec;
+    std::filesystem::create_directories(cacheDir, ec);
+    std::string key = cachePath(a->t.url);
+    std::string tmp = key + "." + std::to_string(getpid());
+    {
+        std::ofstream body(tmp + ".body", std::ios::binary);
+        std::ofstream meta(tmp);
+        body << a->t.body;
+        meta << a->etag << "\n" << a->lastModified << "\n";
+        if (!body || !meta) return;
+    }
+    // body first: a validator must never point at a body we do not have
+    if (::rename((tmp + ".body").c_str(), (key + ".body").c_str()) == 0)
+        ::rename(tmp.c_str(), key.c_str());
+    ::unlink((tmp + ".body").c_str());
+    ::unlink(tmp.c_str());
+}
+
+void Fetcher::answerOffline(Transfer& t) {
+    std::ifstream f;
+    if (!cacheDir.empty() && t.output.empty() && !t.sink && t.range.empty())
+        f.open(cachePath(t.url) + ".body", std::ios::binary);
+    if (f.is_open()) {
+        std::ostringstream ss;
+        ss << f.rdbuf();
+        t.body = ss.str();
+        t.cached = true;
+        t.status = 304;
+    } else {
+        t.error = "offline and not cached";
+    }
+    t.ok = t.error.empty();
+    if (t.done) t.done(t);
+}
+
+CURL* Fetcher::acquire() {
+    CURL* easy;
+    if (!idle.empty()) {
+        easy = idle.back();
+        idle.pop_back();
+        curl_easy_reset(easy);
+    } else {
+        easy = curl_easy_init();
+        if (!easy) return nullptr;
+    }
+    curl_easy_setopt(easy, CURLOPT_SHARE, share);
+    curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+    return easy;
+}
+
+void Fetcher::release(CURL* easy) {
+    idle.push_back(easy);
+}
+
+void Fetcher::add(Transfer t) {
+    pending.push_back(std::move(t));
+}
+
+void Fetcher::wakeup() {
+    woken = true;
+    curl_multi_wakeup(multi);
+}
+
+void Fetcher::start(Transfer t) {
+    if (offline) {
+        answerOffline(t);
+        return;
+    }
+    if (startSplit(t)) return;
+
+    Active* a = new Active{std::move(t)};
+    a->easy = acquire();
+    if (!a->easy) {
+        a->t.error = "curl init failed";
+        if (a->t.done) a->t.done(a->t);
+        delete a;
+        return;
+    }
+
+    a->owner = this;
+    if (a->t.sink) {
+        if (!a->t.sha256.empty() && a->t.delivered == 0)
+            a->t.digest = std::make_shared<Sha256>();
+        a->offset = a->t.delivered;
+        if (a->offset > 0)
+            curl_easy_setopt(a->easy, CURLOPT_RESUME_FROM_LARGE, a->offset);
+        curl_easy_setopt(a->easy, CURLOPT_WRITEFUNCTION, writeSink);
+        curl_easy_setopt(a->easy, CURLOPT_WRITEDATA, a);
+        curl_easy_setopt(a->easy, CURLOPT_LOW_SPEED_LIMIT, 1L);
+        curl_easy_setopt(a->easy, CURLOPT_LOW_SPEED_TIME, 30L);
+    } else if (a->t.output.empty()) {
+        curl_easy_setopt(a->easy, CURLOPT_WRITEFUNCTION, writeBody);
+        curl_easy_setopt(a->easy, CURLOPT_WRITEDATA, &a->t.body);
+        if (!a->t.range.empty()) {
+            curl_easy_setopt(a->easy, CURLOPT_RANGE, a->t.range.c_str());
+            curl_easy_setopt(a->easy, CURLOPT_HEADERFUNCTION, captureHeader);
+            curl_easy_setopt(a->easy, CURLOPT_HEADERDATA, a);
+        } else if (!cacheDir.empty()) {
+            loadCached(a);
+            curl_easy_setopt(a->easy, CURLOPT_HTTPHEADER, a->headers);
+            curl_easy_setopt(a->easy, CURLOPT_HEADERFUNCTION, captureHeader);
+            curl_easy_setopt(a->easy, CURLOPT_HEADERDATA, a);
+        }
+    } else {
+        a->file = std::make_unique<FileSink>();
+        if (!a->file->open(a->t.output + ".part", true, a->t.size, a->t.direct)) {
+            a->t.error = "cannot open " + a->t.output + ".part";
+            release(a->easy);
+            if (a->t.done) a->t.done(a->t);
+            delete a;
+            return;
+        }
+        a->offset = (curl_off_t)a->file->size();
+        if (a->offset > 0)
+            curl_easy_setopt(a->easy, CURLOPT_RESUME_FROM_LARGE, a->offset);
+        // the hash is taken as the body is written; a retry carries it on,
+        // a .part left by an earlier run is read once to catch up
+        if (!a->t.sha256.empty() && (!a->t.digest || a->t.delivered != a->offset)) {
+            a->t.digest = std::make_shared<Sha256>();
+            a->t.delivered = a->offset;
+            if (!hashPrefix(a->file->fd(), a->offset, *a->t.digest)) {
+                a->file->close();
+                ::unlink((a->t.output + ".part").c_str());
+                a->t.error = "cannot read " + a->t.output + ".part";
+                release(a->easy);
+                if (a->t.done) a->t.done(a->t);
+                delete a;
+                return;
+            }
+        }
+        curl_easy_setopt(a->easy, CURLOPT_WRITEFUNCTION, writeFile);
+        curl_easy_setopt(a->easy, CURLOPT_WRITEDATA, a);
+        // treat a stalled connection as dropped so it gets resumed
+        curl_easy_setopt(a->easy, CURLOPT_LOW_SPEED_LIMIT, 1L);
+        curl_easy_setopt(a->easy, CURLOPT_LOW_SPEED_TIME, 30L);
+    }
+    if (a->t.progress) {
+        curl_easy_setopt(a->easy, CURLOPT_XFERINFOFUNCTION, xferInfo);
+        curl_easy_setopt(a->easy, CURLOPT_XFERINFODATA, a);
+        curl_easy_setopt(a->easy, CURLOPT_NOPROGRESS, 0L);
+    }
+    curl_easy_setopt(a->easy, CURLOPT_URL, a->t.url.c_str());
+    curl_easy_setopt(a->easy, CURLOPT_PRIVATE, a);
+    curl_multi_add_handle(multi, a->easy);
+    ++running;
+}
+
+bool Fetcher::startSplit(Transfer& t) {
+    if (t.output.empty() || t.segments < 2 || t.size < 2 * minSegment)
+        return false;
+
+    int n = (int)std::min<curl_off_t>(t.segments, t.size / minSegment);
+    std::string tmp = t.output + ".seg";
+    int fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    if (posix_fallocate(fd, 0, t.size) != 0 && ftruncate(fd, t.size) != 0) {
+        ::close(fd);
+        ::unlink(tmp.c_str());
+        return false;
+    }
+
+    Split* sp = new Split{std::move(t), fd, n};
+    sp->got.assign(n, 0);
+    curl_off_t chunk = sp->t.size / n;
+    for (int i = 0; i < n; ++i) {
+        curl_off_t from = i * chunk;
+        curl_off_t to = i == n - 1 ? sp->t.size - 1 : from + chunk - 1;
+        startSegment(sp, i, from, to, sp->t.retries);
+    }
+    return true;
+}
+
+void Fetcher::startSegment(Split* sp, int seg, curl_off_t from, curl_off_t to, int retries) {
+    Active* a = new Active;
+    a->split = sp;
+    a->seg = seg;
+    a->offset = from;
+    a->to = to;
+    a->retries = retries;
+    a->easy = acquire();
+    if (!a->easy) {
+        sp->error = "curl init failed";
+        finishSegment(a, CURLE_FAILED_INIT);
+        return;
+    }
+
+    std::string range = std::to_string(from) + "-" + std::to_string(to);
+    curl_easy_setopt(a->easy, CURLOPT_URL, sp->t.url.c_str());
+    curl_easy_setopt(a->easy, CURLOPT_RANGE, range.c_str());
+    curl_easy_setopt(a->easy, CURLOPT_WRITEFUNCTION, writeSegment);
+    curl_easy_setopt(a->easy, CURLOPT_WRITEDATA, a);
+    curl_easy_setopt(a->easy, CURLOPT_HEADERFUNCTION, segmentHeader);
+    curl_easy_setopt(a->easy, CURLOPT_HEADERDATA, a);
+    curl_easy_setopt(a->easy, CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt(a->easy, CURLOPT_LOW_SPEED_TIME, 30L);
+    curl_easy_setopt(a->easy, CURLOPT_PRIVATE, a);
+    curl_multi_add_handle(multi, a->easy);
+    ++running;
+}
+
+void Fetcher::finishSegment(Active* a, CURLcode result) {
+    Split* sp = a->split;
+    bool whole = result == CURLE_OK && a->offset == a->to + 1;
+    if (!whole && !sp->fallback && sp->error.empty()) {
+        bool shortRead = result == CURLE_OK && a->t.status < 400;
+        if (a->retries > 0 && (retryable(result, a->t.status) || shortRead)) {
+            startSegment(sp, a->seg, a->offset, a->to, a->retries - 1);
+            delete a;
+            return;
+        }
+        if (result != CURLE_OK && result != CURLE_WRITE_ERROR)
+            sp->error = curl_easy_strerror(result);
+        else if (a->t.status >= 400)
+            sp->error = "HTTP " + std::to_string(a->t.status);
+        else
+            sp->error = "short read on range " + std::to_string(a->seg);
+    }
+    delete a;
+    if (--sp->left == 0) finishSplit(sp);
+}
+
+void Fetcher::finishSplit(Split* sp) {
+    std::string tmp = sp->t.output + ".seg";
+    if (::close(sp->fd) != 0 && sp->error.empty())
+        sp->error = "cannot write " + tmp;
+
+    if (sp->fallback) {
+        ::unlink(tmp.c_str());
+        sp->t.segments = 1;
+        pending.push_front(std::move(sp->t));
+    } else if (!sp->error.empty()) {
+        ::unlink(tmp.c_str());
+        sp->t.error = sp->error;
+        if (sp->t.done) sp->t.done(sp->t);
+    } else {
+        sp->t.status = 206;
+        sp->t.contentLength = sp->t.size;
+        complete(sp->t, tmp);
+    }
+    delete sp;
+}
+
+// Verifies and renames a finished download, then reports it. Only a
+// segmented download, whose ranges arrive out of order, has no running
+// digest and is hashed here.
+void Fetcher::complete(Transfer& t, const std::string& tmp) {
+    if (!t.sha256.empty() && !t.digest && Sha256::file(tmp) != t.sha256) {
+        ::unlink(tmp.c_str());
+        t.error = "sha256 mismatch";
+    } else if (::rename(tmp.c_str(), t.output.c_str()) != 0) {
+        t.error = "cannot rename " + tmp;
+    }
+    t.ok = t.error.empty();
+    if (t.done) t.done(t);
+}
+
+void Fetcher::finish(CURL* easy, CURLcode result) {
+    Active* a = nullptr;
+    curl_easy_getinfo(easy, CURLINFO_PRIVATE, &a);
+    curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &a->t.status);
+    curl_easy_getinfo(easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &a->t.contentLength);
+    curl_multi_remove_handle(multi, easy);
+    release(easy);
+    --running;
+    if (a->paused) paused.erase(std::find(paused.begin(), paused.end(), a));
+
+    if (a->split) {
+        finishSegment(a, result);
+        return;
+    }
+    bool conditional = a->headers != nullptr;
+    curl_slist_free_all(a->headers);
+    a->headers = nullptr;
+
+    if (conditional && result == CURLE_OK && a->t.status == 304) {
+        std::ifstream f(cachePath(a->t.url) + ".body", std::ios::binary);
+        std::ostringstream ss;
+        ss << f.rdbuf();
+        a->t.body = ss.str();
+        a->t.cached = true;
+    } else if (!cacheDir.empty() && a->t.output.empty() && !a->t.sink
+               && a->t.range.empty() && result == CURLE_OK && a->t.status == 200) {
+        storeCached(a);
+    }
+
+    bool closed = !a->file || a->file->close();
+    std::string part = a->t.output + ".part";
+    // the server cannot continue the partial file: start over from zero,
+    // which costs no retry since it cannot happen twice
+    bool restart = a->file && a->offset > 0 && (a->t.status == 416 || result == CURLE_RANGE_ERROR);
+    if (restart) ::unlink(part.c_str());
+
+    if (restart || ((a->file || a->t.sink) && a->t.retries > 0 && retryable(result, a->t.status))) {
+        if (!restart) a->t.retries--;
+        pending.push_front(std::move(a->t));
+        delete a;
+        return;
+    }
+
+    if (result != CURLE_OK)
+        a->t.error = curl_easy_strerror(result);
+    else if (a->t.status >= 400)
+        a->t.error = "HTTP " + std::to_string(a->t.status);
+    else if (!closed)
+        a->t.error = "cannot write " + part;
+    else if (a->t.sink && !a->t.sha256.empty() && !a->t.digest)
+        a->t.error = "sha256 not checked: resumed without a digest";
+    else if (a->t.digest && a->t.digest->hex() != a->t.sha256) {
+        a->t.error = "sha256 mismatch";
+        if (a->file) ::unlink(part.c_str());   // never resume from bad bytes
+    }
+
+    if (a->file && a->t.error.empty()) {
+        complete(a->t, part);
+    } else {
+        a->t.ok = a->t.error.empty();
+        if (a->t.done) a->t.done(a->t);
+    }
+    delete a;
+}
+
+void Fetcher::run() {
+    while (!pending.empty() || running > 0) {
+        while (running < maxParallel && !pending.empty()) {
+            Transfer t = std::move(pending.front());
+            pending.pop_front();
+            start(std::move(t));
+        }
+
+        int still = 0;
+        curl_multi_perform(multi, &still);
+
+        CURLMsg* msg;
+        int left = 0;
+        bool finished = false;
+        while ((msg = curl_multi_info_read(multi, &left))) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            finish(msg->easy_handle, msg->data.result);
+            finished = true;
+        }
+
+        // a finished transfer may have freed a slot or queued a follow-up
+        if (!finished && running > 0)
+            curl_multi_poll(multi, nullptr, 0, 1000, nullptr);
+
+        if (woken.exchange(false)) {
+            std::vector<Active*> retry;
+            retry.swap(paused);
+            for (Active* a : retry) {
+                a->paused = false;
+                curl_easy_pause(a->easy, CURLPAUSE_CONT);
+            }
+        }
+    }
+}
@@ -0,0 +1,151 @@
+#pragma once
+#include <string>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <curl/curl.h>
+
+class Sha256;
+class FileSink;
+
+// With an empty output the body is kept in memory.
+// File downloads land in output + ".part" and are renamed into place once
+// complete, written through a FileSink that reserves size bytes up front
+// (and, with direct set, bypasses the page cache); an existing .part is
+// resumed with a Range request, or started over when the server will not
+// continue it, and a transfer that drops mid-way is retried from where it
+// stopped.
+//
+// In-memory (metadata) bodies are kept in the cache directory, if one is
+// set, together with their ETag / Last-Modified; the next request for the
+// same URL is made conditional and a 304 is answered from the cache.
+// Offline, nothing goes out: cached bodies are served as they are and
+// every other transfer fails.
+// A range ("from-to", or "-n" for the last n bytes) asks for part of the
+// body instead; those are never cached, and total reports the full size.
+//
+// With a sink the body is handed over as it arrives instead. The sink
+// returns the byte count when it took the chunk, 0 when it has no room
+// (the transfer then pauses until wakeup()) or -1 to abort. A dropped
+// sink transfer resumes with a Range request from the bytes delivered.
+// With sha256 set the body is hashed as it is handed over and checked at
+// the end; one that starts with bytes already delivered must be given the
+// digest of those.
+//
+// When the size is known up front and segments > 1, a large file is
+// instead fetched as several concurrent byte ranges written straight into
+// a preallocated output + ".seg". Servers that ignore Range fall back to
+// the single-stream path; a range that gets a 5xx is retried like a
+// dropped one. With sha256 set the finished file is checked against it
+// and discarded on mismatch.
+struct Transfer {
+    std::string url;
+    std::string output;
+    std::function<void(Transfer&)> done;
+    std::function<void(curl_off_t now, curl_off_t total)> progress;
+    std::function<long(const char* data, size_t len)> sink;
+    int retries = 3;
+    curl_off_t size = 0;
+    int segments = 1;
+    std::string sha256;
+    std::string range;
+    bool direct = false;
+
+    // filled in once the transfer finishes
+    std::string body;
+    curl_off_t delivered = 0;
+    std::shared_ptr<Sha256> digest;
+    bool cached = false;
+    bool ok = false;
+    long status = 0;
+    curl_off_t contentLength = -1;
+    curl_off_t total = -1;
+    std::string error;
+};
+
+// Drives any number of transfers through one curl multi handle,
+// at most maxParallel of them in flight at a time. Meant to live for the
+// whole process: easy handles are recycled and DNS, TLS sessions and
+// connections are shared, so repeated requests to the same host skip
+// the TCP and TLS handshakes.
+class Fetcher {
+public:
+    explicit Fetcher(int maxParallel = 8);
+    ~Fetcher();
+    Fetcher(const Fetcher&) = delete;
+    Fetcher& operator=(const Fetcher&) = delete;
+
+    void setMaxParallel(int n);
+    void setCacheDir(const std::string& dir);
+    void setOffline(bool on);
+
+    // done callbacks run inside run() and may queue further transfers
+    void add(Transfer t);
+    void run();
+
+    // safe from any thread: lets paused sink transfers try again
+    void wakeup();
+
+private:
+    struct Split {
+        Transfer t;
+        int fd = -1;
+        int left = 0;
+        bool fallback = false;
+        std::string error;
+        std::vector<curl_off_t> got;
+    };
+
+    struct Active {
+        Transfer t;
+        CURL* easy = nullptr;
+        std::unique_ptr<FileSink> file;
+        curl_off_t offset = 0;
+        Fetcher* owner = nullptr;
+        bool checked = false;
+        bool discard = false;
+        bool paused = false;
+        curl_slist* headers = nullptr;
+        std::string etag;
+        std::string lastModified;
+
+        // set for one byte range of a segmented download
+        Split* split = nullptr;
+        int seg = 0;
+        curl_off_t to = 0;
+        int retries = 0;
+    };
+
+    CURLM* multi;
+    CURLSH* share;
+    int maxParallel;
+    std::string cacheDir;
+    bool offline = false;
+    int running = 0;
+    std::deque<Transfer> pending;
+    std::vector<CURL*> idle;
+    std::vector<Active*> paused;
+    std::atomic<bool> woken{false};
+
+    CURL* acquire();
+    void release(CURL* easy);
+    void start(Transfer t);
+    void finish(CURL* easy, CURLcode result);
+    std::string cachePath(const std::string& url);
+    void loadCached(Active* a);
+    void storeCached(Active* a);
+    void answerOffline(Transfer& t);
+    bool startSplit(Transfer& t);
+    void startSegment(Split* sp, int seg, curl_off_t from, curl_off_t to, int retries);
+    void finishSegment(Active* a, CURLcode result);
+    void finishSplit(Split* sp);
+    void complete(Transfer& t, const std::string& tmp);
+    static size_t writeFile(char* ptr, size_t size, size_t nmemb, void* userp);
+    static size_t writeSink(char* ptr, size_t size, size_t nmemb, void* userp);
+    static size_t writeSegment(char* ptr, size_t size, size_t nmemb, void* userp);
+    static size_t captureHeader(char* buf, size_t size, size_t nitems, void* userp);
+    static size_t segmentHeader(char* buf, size_t size, size_t nitems, void* userp);
+    static int xferInfo(void* userp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t, curl_off_t);
+};
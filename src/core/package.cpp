@@ -0,0 +1,479 @@
+#include "package.hpp"
+#include "hash.hpp"
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef PACMANOC_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// frames larger than this are refused rather than allocated
+static const uint32_t maxFrameSize = 256u << 20;
+
+// generous upper bound on what zstd can turn n bytes into
+static uint64_t packedBound(uint32_t n) {
+    return n + (n >> 7) + (64 << 10);
+}
+
+static void put16(char* p, uint16_t v) {
+    for (int i = 0; i < 2; ++i) p[i] = (char)(v >> (8 * i));
+}
+
+static void put32(char* p, uint32_t v) {
+    for (int i = 0; i < 4; ++i) p[i] = (char)(v >> (8 * i));
+}
+
+static void put64(char* p, uint64_t v) {
+    for (int i = 0; i < 8; ++i) p[i] = (char)(v >> (8 * i));
+}
+
+static uint32_t get32(const char* p) {
+    uint32_t v = 0;
+    for (int i = 3; i >= 0; --i) v = (v << 8) | (unsigned char)p[i];
+    return v;
+}
+
+static uint16_t get16(const char* p) {
+    return (uint16_t)((unsigned char)p[0] | ((unsigned char)p[1] << 8));
+}
+
+static uint64_t get64(const char* p) {
+    return get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+bool zstdSupported() {
+#ifdef PACMANOC_HAVE_ZSTD
+    return true;
+#else
+    return false;
+#endif
+}
+
+// out must already be sized to the frame's raw size
+static bool decompress(const char* in, size_t n, std::vector<char>& out) {
+#ifdef PACMANOC_HAVE_ZSTD
+    size_t r = ZSTD_decompress(out.data(), out.size(), in, n);
+    return !ZSTD_isError(r) && r == out.size();
+#else
+    (void)in;
+    (void)n;
+    (void)out;
+    return false;
+#endif
+}
+
+static std::vector<char> compress(const char* in, size_t n, int level) {
+#ifdef PACMANOC_HAVE_ZSTD
+    std::vector<char> out(ZSTD_compressBound(n));
+    ZSTD_CCtx* cctx = ZSTD_createCCtx();
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+    size_t r = ZSTD_compress2(cctx, out.data(), out.size(), in, n);
+    ZSTD_freeCCtx(cctx);
+    out.resize(ZSTD_isError(r) ? 0 : r);
+    return out;
+#else
+    (void)in;
+    (void)n;
+    (void)level;
+    return {};
+#endif
+}
+
+bool PackageFooter::parse(const std::string& tail, uint64_t fileSize, uint64_t& need, std::string& error) {
+    need = 0;
+    if (fileSize < packageHeaderSize + packageTrailerSize || tail.size() < packageTrailerSize) {
+        error = "not an .ocpackage v2 file";
+        return false;
+    }
+    const char* tr = tail.data() + tail.size() - packageTrailerSize;
+    if (memcmp(tr + 24, packageEndMagic, 8) != 0) {
+        error = "not an .ocpackage v2 file (legacy archives have no index)";
+        return false;
+    }
+    uint64_t tableOffset = get64(tr);
+    uint32_t count = get32(tr + 8);
+    uint64_t indexOffset = get64(tr + 16);
+    frameSize = get32(tr + 12);
+    uint64_t footer = fileSize - tableOffset;
+    if (tableOffset < packageHeaderSize || tableOffset + (uint64_t)count * 16 + packageTrailerSize > fileSize
+        || (indexOffset && (indexOffset < tableOffset + (uint64_t)count * 16 || indexOffset + 8 > fileSize - packageTrailerSize))
+        || frameSize == 0 || frameSize > maxFrameSize) {
+        error = "corrupt .ocpackage footer";
+        return false;
+    }
+    if (tail.size() < footer) {
+        need = footer;
+        return false;
+    }
+
+    const char* base = tail.data() + tail.size() - footer;
+    frames.resize(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        const char* p = base + i * 16;
+        frames[i] = {get64(p), get32(p + 8), get32(p + 12)};
+    }
+    files.clear();
+    indexed = indexOffset != 0;
+    if (!indexed) return true;
+
+    const char* p = base + (indexOffset - tableOffset);
+    const char* end = tail.data() + tail.size() - packageTrailerSize;
+    uint32_t csize = get32(p), rsize = get32(p + 4);
+    if (csize > (uint64_t)(end - p - 8) || rsize < 4) {
+        error = "corrupt .ocpackage index";
+        return false;
+    }
+    std::vector<char> idx(rsize);
+    if (!decompress(p + 8, csize, idx)) {
+        error = zstdSupported() ? "corrupt .ocpackage index" : "pacmanoc was built without zstd support";
+        return false;
+    }
+
+    const char* q = idx.data();
+    const char* qend = q + idx.size();
+    uint32_t n = get32(q);
+    q += 4;
+    files.reserve(std::min<size_t>(n, idx.size() / 36));
+    for (uint32_t i = 0; i < n; ++i) {
+        if (qend - q < 36) break;
+        Entry e;
+        e.offset = get64(q);
+        e.size = get64(q + 8);
+        e.mtime = (int64_t)get64(q + 16);
+        e.mode = get32(q + 24);
+        e.type = q[28];
+        size_t hashLen = (unsigned char)q[29], pathLen = get16(q + 30), linkLen = get16(q + 32);
+        q += 36;
+        if ((size_t)(qend - q) < pathLen + linkLen + hashLen) break;
+        e.path.assign(q, pathLen);
+        e.link.assign(q + pathLen, linkLen);
+        static const char digits[] = "0123456789abcdef";
+        for (size_t k = 0; k < hashLen; ++k) {
+            unsigned char c = q[pathLen + linkLen + k];
+            e.sha256 += digits[c >> 4];
+            e.sha256 += digits[c & 15];
+        }
+        q += pathLen + linkLen + hashLen;
+        files.push_back(std::move(e));
+    }
+    if (files.size() != n) {
+        error = "corrupt .ocpackage index";
+        return false;
+    }
+    return true;
+}
+
+const Entry* PackageFooter::find(const std::string& path) const {
+    auto it = std::lower_bound(files.begin(), files.end(), path,
+                               [](const Entry& e, const std::string& p) { return e.path < p; });
+    return it != files.end() && it->path == path ? &*it : nullptr;
+}
+
+void PackageFooter::span(const Entry& e, uint64_t& from, uint64_t& to) const {
+    from = to = 0;
+    if (e.size == 0 || frames.empty()) return;
+    size_t first = std::min<size_t>(e.offset / frameSize, frames.size() - 1);
+    size_t last = std::min<size_t>((e.offset + e.size - 1) / frameSize, frames.size() - 1);
+    from = frames[first].offset;
+    to = frames[last].offset + 8 + frames[last].compressed;
+}
+
+bool PackageFooter::body(const Entry& e, const std::string& packed, std::string& out, std::string& error) const {
+    out.clear();
+    uint64_t from, to;
+    span(e, from, to);
+    if (packed.size() != to - from) {
+        error = "short read";
+        return false;
+    }
+    std::vector<char> raw;
+    for (size_t i = e.offset / frameSize; out.size() < e.size && i < frames.size(); ++i) {
+        const FrameSlot& f = frames[i];
+        raw.assign(f.raw, 0);
+        if (f.offset + 8 + f.compressed > to || !decompress(packed.data() + (f.offset - from) + 8, f.compressed, raw)) {
+            error = "corrupt .ocpackage frame";
+            return false;
+        }
+        uint64_t start = i * (uint64_t)frameSize;
+        size_t skip = e.offset > start ? (size_t)(e.offset - start) : 0;
+        if (skip > raw.size()) break;
+        size_t take = (size_t)std::min<uint64_t>(raw.size() - skip, e.size - out.size());
+        out.append(raw.data() + skip, take);
+    }
+    if (out.size() != e.size) {
+        error = "member runs past the end of the package";
+        return false;
+    }
+    if (!e.sha256.empty()) {
+        Sha256 sha;
+        sha.update(out.data(), out.size());
+        if (sha.hex() != e.sha256) {
+            error = "sha256 mismatch";
+            return false;
+        }
+    }
+    return true;
+}
+
+FrameDecoder::FrameDecoder(Source& in, int threads) : in(in), threads(std::max(1, threads)) {}
+
+FrameDecoder::~FrameDecoder() {
+    // outstanding tasks only touch their own buffers; wait them out
+    for (auto& f : ahead) f.wait();
+}
+
+bool FrameDecoder::readExact(char* out, size_t n) {
+    while (n > 0) {
+        size_t r = in.read(out, n);
+        if (r == 0) return false;
+        out += r;
+        n -= r;
+    }
+    return true;
+}
+
+bool FrameDecoder::header() {
+    char h[packageHeaderSize];
+    if (!readExact(h, sizeof(h)) || memcmp(h, packageMagic, 4) != 0) {
+        message = "not an .ocpackage v2 file";
+        return false;
+    }
+    if (get16(h + 4) != packageVersion) {
+        message = "unsupported .ocpackage version " + std::to_string(get16(h + 4));
+        return false;
+    }
+    frameSize = get32(h + 8);
+    if (frameSize == 0 || frameSize > maxFrameSize) {
+        message = "bad .ocpackage frame size";
+        return false;
+    }
+#ifndef PACMANOC_HAVE_ZSTD
+    message = "pacmanoc was built without zstd support";
+    return false;
+#endif
+    return true;
+}
+
+
+// Reads the next frame record and schedules its decompression.
+bool FrameDecoder::queue() {
+    char rec[8];
+    if (!readExact(rec, sizeof(rec))) {
+        message = "truncated .ocpackage";
+        return false;
+    }
+    uint32_t csize = get32(rec), rsize = get32(rec + 4);
+    if (csize == 0 && rsize == 0) {
+        last = true;
+        return true;
+    }
+    if (csize == 0 || rsize == 0 || rsize > frameSize || csize > packedBound(frameSize)) {
+        message = "corrupt .ocpackage frame record";
+        return false;
+    }
+    std::vector<char> packed(csize);
+    if (!readExact(packed.data(), csize)) {
+        message = "truncated .ocpackage";
+        return false;
+    }
+    auto task = [packed = std::move(packed), rsize]() {
+        Frame f;
+        f.data.resize(rsize);
+        f.ok = decompress(packed.data(), packed.size(), f.data);
+        return f;
+    };
+    // with a single thread the frame is decoded when it is needed, inline
+    ahead.push_back(std::async(threads > 1 ? std::launch::async : std::launch::deferred, std::move(task)));
+    return true;
+}
+
+size_t FrameDecoder::read(char* out, size_t n) {
+    if (!message.empty()) return 0;
+    if (!started) {
+        started = true;
+        if (!header()) return 0;
+    }
+    while (pos == cur.data.size()) {
+        while (!last && (int)ahead.size() < threads)
+            if (!queue()) return 0;
+        if (ahead.empty()) return 0;
+        cur = ahead.front().get();
+        ahead.pop_front();
+        pos = 0;
+        if (!cur.ok) {
+            message = "corrupt .ocpackage frame";
+            return 0;
+        }
+    }
+    size_t got = std::min(n, cur.data.size() - pos);
+    memcpy(out, cur.data.data() + pos, got);
+    pos += got;
+    return got;
+}
+
+PackageWriter::PackageWriter(const std::string& path, size_t frameSize, int threads, int level)
+    : path(path), tmp(path + ".tmp"), frameSize(std::min<size_t>(std::max<size_t>(frameSize, 64 << 10), maxFrameSize)),
+      threads(std::max(1, threads)), level(level) {
+#ifndef PACMANOC_HAVE_ZSTD
+    message = "pacmanoc was built without zstd support";
+    return;
+#endif
+    fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        message = tmp + ": " + strerror(errno);
+        return;
+    }
+    char h[packageHeaderSize] = {};
+    memcpy(h, packageMagic, 4);
+    put16(h + 4, packageVersion);
+    put32(h + 8, (uint32_t)this->frameSize);
+    put(h, sizeof(h));
+    frame.reserve(this->frameSize);
+}
+
+PackageWriter::~PackageWriter() {
+    if (fd >= 0) ::close(fd);
+    if (!done) ::unlink(tmp.c_str());
+}
+
+bool PackageWriter::put(const char* data, size_t n) {
+    while (n > 0) {
+        ssize_t w = ::write(fd, data, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) {
+            message = tmp + ": " + strerror(errno);
+            return false;
+        }
+        data += w;
+        n -= w;
+        offset += w;
+    }
+    return true;
+}
+
+bool PackageWriter::write(const char* data, size_t n) {
+    if (!message.empty()) return false;
+    raw += n;
+    while (n > 0) {
+        size_t take = std::min(n, frameSize - frame.size());
+        frame.insert(frame.end(), data, data + take);
+        data += take;
+        n -= take;
+        if (frame.size() == frameSize) {
+            batch.push_back(std::move(frame));
+            frame.clear();
+            frame.reserve(frameSize);
+            if ((int)batch.size() == threads && !flush()) return false;
+        }
+    }
+    return true;
+}
+
+// Compresses the batched frames side by side and appends them in order.
+bool PackageWriter::flush() {
+    std::vector<std::future<std::vector<char>>> packed;
+    for (auto& f : batch) {
+        packed.push_back(std::async(batch.size() > 1 ? std::launch::async : std::launch::deferred,
+                                    [&f, this] { return compress(f.data(), f.size(), level); }));
+    }
+    for (size_t i = 0; i < batch.size(); ++i) {
+        std::vector<char> out = packed[i].get();
+        if (out.empty()) {
+            if (message.empty()) message = "zstd compression failed";
+            continue;
+        }
+        if (!message.empty()) continue;
+        char rec[8];
+        put32(rec, (uint32_t)out.size());
+        put32(rec + 4, (uint32_t)batch[i].size());
+        table.push_back({offset, (uint32_t)out.size(), (uint32_t)batch[i].size()});
+        if (!put(rec, sizeof(rec))) continue;
+        put(out.data(), out.size());
+    }
+    batch.clear();
+    return message.empty();
+}
+
+bool PackageWriter::putIndex(const std::vector<Entry>& files) {
+    std::vector<const Entry*> sorted;
+    for (auto& e : files) sorted.push_back(&e);
+    std::sort(sorted.begin(), sorted.end(), [](const Entry* a, const Entry* b) { return a->path < b->path; });
+
+    std::vector<char> idx(4);
+    put32(idx.data(), (uint32_t)sorted.size());
+    for (const Entry* e : sorted) {
+        std::string hash;
+        for (size_t i = 0; i + 1 < e->sha256.size(); i += 2)
+            hash += (char)std::stoi(e->sha256.substr(i, 2), nullptr, 16);
+        size_t pathLen = std::min<size_t>(e->path.size(), 0xffff), linkLen = std::min<size_t>(e->link.size(), 0xffff);
+        char rec[36] = {};
+        put64(rec, e->offset);
+        put64(rec + 8, e->size);
+        put64(rec + 16, (uint64_t)e->mtime);
+        put32(rec + 24, e->mode);
+        rec[28] = e->type;
+        rec[29] = (char)hash.size();
+        put16(rec + 30, (uint16_t)pathLen);
+        put16(rec + 32, (uint16_t)linkLen);
+        idx.insert(idx.end(), rec, rec + sizeof(rec));
+        idx.insert(idx.end(), e->path.data(), e->path.data() + pathLen);
+        idx.insert(idx.end(), e->link.data(), e->link.data() + linkLen);
+        idx.insert(idx.end(), hash.begin(), hash.end());
+    }
+
+    std::vector<char> out = compress(idx.data(), idx.size(), level);
+    if (out.empty()) {
+        message = "zstd compression failed";
+        return false;
+    }
+    char rec[8];
+    put32(rec, (uint32_t)out.size());
+    put32(rec + 4, (uint32_t)idx.size());
+    return put(rec, sizeof(rec)) && put(out.data(), out.size());
+}
+
+bool PackageWriter::finish(const std::vector<Entry>& files) {
+    if (!message.empty()) return false;
+    if (!frame.empty()) batch.push_back(std::move(frame));
+    frame.clear();
+    if (!batch.empty() && !flush()) return false;
+
+    char end[8] = {};
+    if (!put(end, sizeof(end))) return false;
+
+    uint64_t tableOffset = offset;
+    std::vector<char> t(table.size() * 16);
+    for (size_t i = 0; i < table.size(); ++i) {
+        put64(&t[i * 16], table[i].offset);
+        put32(&t[i * 16 + 8], table[i].compressed);
+        put32(&t[i * 16 + 12], table[i].raw);
+    }
+    if (!put(t.data(), t.size())) return false;
+    uint64_t indexOffset = offset;
+    if (!putIndex(files)) return false;
+
+    char tr[packageTrailerSize] = {};
+    put64(tr, tableOffset);
+    put32(tr + 8, (uint32_t)table.size());
+    put32(tr + 12, (uint32_t)frameSize);
+    put64(tr + 16, indexOffset);
+    memcpy(tr + 24, packageEndMagic, 8);
+    if (!put(tr, sizeof(tr))) return false;
+
+    if (::fsync(fd) != 0 || ::close(fd) != 0) {
+        fd = -1;
+        message = tmp + ": " + strerror(errno);
+        return false;
+    }
+    fd = -1;
+    if (::rename(tmp.c_str(), path.c_str()) != 0) {
+        message = path + ": " + strerror(errno);
+        return false;
+    }
+    done = true;
+    return true;
+}
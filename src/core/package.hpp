@@ -0,0 +1,142 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <future>
+#include <cstdint>
+#include "stream.hpp"
+#include "archive.hpp"
+
+// .ocpackage v2: the tar stream cut into frames of a fixed uncompressed
+// size, each compressed as its own zstd frame so that any of them can be
+// decoded without the others.
+//
+//   header    "OCPK"  u16 version  u16 flags  u32 frameSize  u32 reserved
+//   frames    u32 compressedSize  u32 rawSize  <zstd frame>   ... repeated,
+//             then a record with both sizes 0
+//   table     u64 offset  u32 compressedSize  u32 rawSize     per frame
+//   index     u32 compressedSize  u32 rawSize  <zstd frame>
+//   trailer   u64 tableOffset  u32 frameCount  u32 frameSize
+//             u64 indexOffset  "OCPKEND\0"
+//
+// Integers are little-endian and offsets point at a frame's size record.
+// The size records let the stream be read front to back while it is still
+// downloading; the table and fixed-size trailer give random access to a
+// complete file. Anything not starting with the magic is a legacy archive.
+//
+// The index lists every member in path order: u32 count, then for each
+//   u64 offset  u64 size  i64 mtime  u32 mode  u8 type  u8 hashLen
+//   u16 pathLen  u16 linkLen  path  link  sha256
+// where offset is where the body starts in the tar stream. Every frame but
+// the last holds exactly frameSize bytes, so that maps straight to the
+// frames to decode. An indexOffset of 0 means the package has no index.
+const char packageMagic[4] = {'O', 'C', 'P', 'K'};
+const char packageEndMagic[8] = {'O', 'C', 'P', 'K', 'E', 'N', 'D', '\0'};
+const uint16_t packageVersion = 2;
+const size_t packageHeaderSize = 16;
+const size_t packageTrailerSize = 32;
+
+bool zstdSupported();
+
+struct FrameSlot {
+    uint64_t offset;
+    uint32_t compressed;
+    uint32_t raw;
+};
+
+// The footer of a v2 package, read without touching the frames.
+struct PackageFooter {
+    uint32_t frameSize = 0;
+    std::vector<FrameSlot> frames;
+    std::vector<Entry> files;   // sorted by path
+    bool indexed = false;
+
+    // how much of the tail to fetch first; enough for most packages
+    static const size_t probe = 64 << 10;
+
+    // tail holds the last bytes of a package of fileSize bytes. When it is
+    // too short, returns false with need set to the tail length required.
+    bool parse(const std::string& tail, uint64_t fileSize, uint64_t& need, std::string& error);
+
+    const Entry* find(const std::string& path) const;
+
+    // the byte range [from, to) of the package holding e's body
+    void span(const Entry& e, uint64_t& from, uint64_t& to) const;
+
+    // e's body, out of the bytes span() named; checked against its hash
+    bool body(const Entry& e, const std::string& packed, std::string& out, std::string& error) const;
+};
+
+// Turns a v2 package, positioned at its header, back into the tar stream.
+// Frames are read in order on the calling thread and decompressed by up to
+// `threads` tasks ahead of the reader.
+class FrameDecoder : public Source {
+public:
+    FrameDecoder(Source& in, int threads = 1);
+    ~FrameDecoder();
+    FrameDecoder(const FrameDecoder&) = delete;
+    FrameDecoder& operator=(const FrameDecoder&) = delete;
+
+    size_t read(char* out, size_t n) override;
+    bool failed() override { return !message.empty() || in.failed(); }
+    const std::string& error() const { return message; }
+
+private:
+    struct Frame {
+        std::vector<char> data;
+        bool ok = false;
+    };
+
+    Source& in;
+    int threads;
+    uint32_t frameSize = 0;
+    bool started = false;
+    bool last = false;
+    std::string message;
+    std::deque<std::future<Frame>> ahead;
+    Frame cur;
+    size_t pos = 0;
+
+    bool readExact(char* out, size_t n);
+    bool header();
+    bool queue();
+};
+
+// Writes a v2 package: feed it the tar stream with write(), then finish()
+// with the members written, for the index. Frames are compressed
+// `threads` at a time. The file is built under path + ".tmp" and only
+// renamed into place by finish().
+class PackageWriter {
+public:
+    PackageWriter(const std::string& path, size_t frameSize = 4 << 20, int threads = 1, int level = 12);
+    ~PackageWriter();
+    PackageWriter(const PackageWriter&) = delete;
+    PackageWriter& operator=(const PackageWriter&) = delete;
+
+    bool write(const char* data, size_t n);
+    bool finish(const std::vector<Entry>& files);
+
+    const std::string& error() const { return message; }
+    uint64_t rawBytes() const { return raw; }
+    uint64_t packedBytes() const { return offset; }
+    size_t frames() const { return table.size(); }
+
+private:
+    std::string path;
+    std::string tmp;
+    int fd = -1;
+    size_t frameSize;
+    int threads;
+    int level;
+    bool done = false;
+    std::string message;
+    std::vector<char> frame;
+    std::vector<std::vector<char>> batch;
+    std::vector<FrameSlot> table;
+    uint64_t offset = 0;
+    uint64_t raw = 0;
+
+    bool put(const char* data, size_t n);
+    bool flush();
+    bool putIndex(const std::vector<Entry>& files);
+};
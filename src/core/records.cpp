@@ -0,0 +1,130 @@
+#include "records.hpp"
+#include <cstring>
+
+namespace {
+const size_t blockSize = 64 << 10;
+}
+
+std::string FileView::hash() const {
+    static const char digits[] = "0123456789abcdef";
+    if (!sha256) return "";
+    std::string out(64, '0');
+    for (size_t i = 0; i < 32; ++i) {
+        out[2 * i] = digits[sha256[i] >> 4];
+        out[2 * i + 1] = digits[sha256[i] & 15];
+    }
+    return out;
+}
+
+char* Arena::take(size_t n) {
+    if (n > left) {
+        // a string bigger than a block gets one of its own
+        size_t size = n > blockSize ? n : blockSize;
+        blocks.push_back(std::make_unique<char[]>(size));
+        at = blocks.back().get();
+        left = size;
+    }
+    char* p = at;
+    at += n;
+    left -= n;
+    return p;
+}
+
+std::string_view Arena::copy(std::string_view s) {
+    if (s.empty()) return {};
+    char* p = take(s.size());
+    memcpy(p, s.data(), s.size());
+    return std::string_view(p, s.size());
+}
+
+std::string_view Arena::intern(std::string_view s) {
+    auto it = seen.find(s);
+    if (it != seen.end()) return *it;
+    std::string_view out = copy(s);
+    seen.insert(out);
+    return out;
+}
+
+void Arena::clear() {
+    blocks.clear();
+    seen.clear();
+    at = nullptr;
+    left = 0;
+}
+
+void PackageTable::add(std::string_view name, std::string_view version, std::string_view destination,
+                       int64_t installed, bool manifest) {
+    uint32_t row = (uint32_t)names.size();
+    names.push_back(strings.intern(name));
+    versions.push_back(strings.intern(version));
+    destinations.push_back(strings.intern(destination));
+    sizes.push_back(0);
+    installTimes.push_back(installed);
+    manifests.push_back(manifest);
+    firstFiles.push_back((uint32_t)fileRows.size());
+    fileCounts.push_back(0);
+    rows[names.back()] = row;
+}
+
+void PackageTable::addFile(const FileView& f) {
+    FileView n = f;
+    n.path = strings.copy(f.path);
+    n.link = strings.intern(f.link);
+    if (f.sha256) {
+        std::string_view h = strings.copy(std::string_view((const char*)f.sha256, 32));
+        n.sha256 = (const uint8_t*)h.data();
+    }
+    fileRows.push_back(n);
+    ++fileCounts.back();
+    if (n.type == '0') sizes.back() += n.size;
+}
+
+bool PackageTable::erase(std::string_view name) {
+    return rows.erase(name) > 0;
+}
+
+void PackageTable::clear() {
+    rows.clear();
+    names.clear();
+    versions.clear();
+    destinations.clear();
+    sizes.clear();
+    installTimes.clear();
+    manifests.clear();
+    firstFiles.clear();
+    fileCounts.clear();
+    fileRows.clear();
+    strings.clear();
+}
+
+PackageView PackageTable::view(uint32_t row) const {
+    PackageView v;
+    v.name = names[row];
+    v.version = versions[row];
+    v.destination = destinations[row];
+    v.size = sizes[row];
+    v.installed = installTimes[row];
+    v.manifest = manifests[row];
+    return v;
+}
+
+bool PackageTable::get(std::string_view name, PackageView& out) const {
+    auto it = rows.find(name);
+    if (it == rows.end()) return false;
+    out = view(it->second);
+    return true;
+}
+
+std::vector<FileView> PackageTable::files(std::string_view name) const {
+    auto it = rows.find(name);
+    if (it == rows.end()) return {};
+    auto first = fileRows.begin() + firstFiles[it->second];
+    return std::vector<FileView>(first, first + fileCounts[it->second]);
+}
+
+std::vector<PackageView> PackageTable::packages() const {
+    std::vector<PackageView> out;
+    out.reserve(rows.size());
+    for (auto& [name, row] : rows) out.push_back(view(row));
+    return out;
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstdint>
+#include <cstddef>
+
+// One installed package. The views point into the database and stay valid
+// until its next load() or save().
+struct PackageView {
+    std::string_view name;
+    std::string_view version;
+    std::string_view destination;
+    uint64_t size = 0;          // bytes of regular files in the manifest
+    int64_t installed = 0;      // unix time, 0 if installed before it was kept
+    bool manifest = false;      // false for packages installed before manifests
+};
+
+// One path a package installed, relative to its destination.
+struct FileView {
+    std::string_view path;
+    std::string_view link;      // symlink or hardlink target
+    uint64_t size = 0;
+    uint32_t mode = 0;
+    char type = '0';            // tar typeflag: '0' file, '1' hardlink, '2' symlink, '5' dir, '6' fifo
+    const uint8_t* sha256 = nullptr;    // 32 bytes, nullptr when not hashed
+
+    std::string hash() const;   // sha256 in hex, "" when not hashed
+};
+
+// Strings copied into blocks that never move, so views of them stay valid
+// until clear(). intern() hands out one copy per distinct string.
+class Arena {
+public:
+    std::string_view copy(std::string_view s);
+    std::string_view intern(std::string_view s);
+    void clear();
+
+private:
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char* at = nullptr;
+    size_t left = 0;
+    std::unordered_set<std::string_view> seen;
+
+    char* take(size_t n);
+};
+
+// Packages held in memory, one column per field rather than one object per
+// package; names, versions and destinations are interned, paths copied,
+// all into one arena. Rows are only appended: adding a package again gives
+// it a new row and erasing one just forgets its row.
+class PackageTable {
+public:
+    // a new row for name, whose files are then given one by one to addFile
+    void add(std::string_view name, std::string_view version, std::string_view destination,
+             int64_t installed, bool manifest);
+    void addFile(const FileView& f);
+    bool erase(std::string_view name);
+    void clear();
+
+    bool contains(std::string_view name) const { return rows.count(name) > 0; }
+    bool get(std::string_view name, PackageView& out) const;
+    std::vector<FileView> files(std::string_view name) const;
+    // every package, in no particular order
+    std::vector<PackageView> packages() const;
+    size_t size() const { return rows.size(); }
+
+private:
+    Arena strings;
+    std::vector<std::string_view> names;
+    std::vector<std::string_view> versions;
+    std::vector<std::string_view> destinations;
+    std::vector<uint64_t> sizes;
+    std::vector<int64_t> installTimes;
+    std::vector<uint8_t> manifests;
+    std::vector<uint32_t> firstFiles;
+    std::vector<uint32_t> fileCounts;
+    std::vector<FileView> fileRows;
+    std::unordered_map<std::string_view, uint32_t> rows;
+
+    PackageView view(uint32_t row) const;
+};
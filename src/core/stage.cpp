@@ -0,0 +1,135 @@
+#include "stage.hpp"
+#include <algorithm>
+#include <filesystem>
+#include <unordered_set>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace fs = std::filesystem;
+
+static const std::string stagePrefix = ".pacmanoc-stage.";
+
+Stage::Stage(const std::string& dest, const std::string& name) : dest(dest) {
+    std::error_code ec;
+    fs::create_directories(dest, ec);
+    dir = (fs::path(dest) / (stagePrefix + std::to_string(::getpid()) + "." + name)).string();
+    fs::remove_all(dir, ec);
+    destfd = ::open(dest.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (destfd < 0 || ::mkdir(dir.c_str(), 0700) != 0
+        || (stagefd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        message = "cannot stage in " + dest + ": " + strerror(errno);
+        return;
+    }
+    struct stat st;
+    if (::fstat(stagefd, &st) == 0) dev = st.st_dev;
+}
+
+Stage::~Stage() {
+    if (stagefd >= 0) ::close(stagefd);
+    if (destfd >= 0) ::close(destfd);
+    std::error_code ec;
+    fs::remove_all(dir, ec);
+}
+
+bool Stage::sync() {
+    if (stagefd < 0) return false;
+    if (::syncfs(stagefd) != 0) {
+        message = "syncfs " + dest + ": " + strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+// renameat2 where the filesystem takes the flag, plain rename where not;
+// exchanged says whether the old target now sits where the new one was.
+static int move(int fromfd, const std::string& path, int tofd, unsigned flags, bool& exchanged) {
+    exchanged = false;
+    if (::renameat2(fromfd, path.c_str(), tofd, path.c_str(), flags) == 0) {
+        exchanged = flags & RENAME_EXCHANGE;
+        return 0;
+    }
+    if (errno != EINVAL && errno != ENOSYS) return errno;
+    return ::renameat(fromfd, path.c_str(), tofd, path.c_str()) == 0 ? 0 : errno;
+}
+
+bool Stage::activate(const std::vector<Entry>& files) {
+    if (stagefd < 0) return false;
+
+    // parents sort before what they contain
+    std::vector<const Entry*> order;
+    for (auto& e : files)
+        if (!e.path.empty()) order.push_back(&e);
+    std::sort(order.begin(), order.end(), [](const Entry* a, const Entry* b) { return a->path < b->path; });
+
+    std::unordered_set<std::string> movedDirs, realDirs;
+    std::vector<Move> done;
+    for (const Entry* e : order) {
+        const std::string& p = e->path;
+        bool inside = false;
+        for (size_t slash = p.find('/'); slash != std::string::npos && !inside; slash = p.find('/', slash + 1))
+            inside = movedDirs.count(p.substr(0, slash)) > 0;
+        if (inside) continue;
+
+        // what is already in dest may hold symlinks; never move through one
+        struct stat st;
+        int err = 0;
+        for (size_t slash = p.find('/'); slash != std::string::npos && !err; slash = p.find('/', slash + 1)) {
+            std::string dir = p.substr(0, slash);
+            if (realDirs.count(dir)) continue;
+            if (::fstatat(destfd, dir.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) err = errno;
+            else if (!S_ISDIR(st.st_mode)) err = ENOTDIR;
+            else realDirs.insert(dir);
+        }
+        if (err) {
+            message = (fs::path(dest) / p).string() + ": " + strerror(err);
+            rollback(done);
+            return false;
+        }
+
+        bool exists = ::fstatat(destfd, p.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0;
+        bool exchanged = false;
+        if (exists && S_ISDIR(st.st_mode)) {
+            // merge into a directory that is already there
+            if (e->type != '5') err = EISDIR;
+            else continue;
+        } else if (e->type == '5') {
+            if (exists) err = ENOTDIR;
+            else if (!(err = move(stagefd, p, destfd, RENAME_NOREPLACE, exchanged))) movedDirs.insert(p);
+        } else {
+            err = move(stagefd, p, destfd, exists ? RENAME_EXCHANGE : RENAME_NOREPLACE, exchanged);
+        }
+        if (err) {
+            message = (fs::path(dest) / p).string() + ": " + strerror(err);
+            rollback(done);
+            return false;
+        }
+        done.push_back({p, exchanged});
+    }
+    return true;
+}
+
+void Stage::rollback(const std::vector<Move>& done) {
+    for (auto it = done.rbegin(); it != done.rend(); ++it) {
+        if (it->exchanged)
+            ::renameat2(destfd, it->path.c_str(), stagefd, it->path.c_str(), RENAME_EXCHANGE);
+        else
+            ::renameat(destfd, it->path.c_str(), stagefd, it->path.c_str());
+    }
+}
+
+void Stage::cleanStale(const std::string& dest) {
+    std::error_code ec;
+    for (auto it = fs::directory_iterator(dest, ec); !ec && it != fs::directory_iterator(); it.increment(ec)) {
+        std::string name = it->path().filename().string();
+        if (name.compare(0, stagePrefix.size(), stagePrefix) != 0) continue;
+        pid_t pid = (pid_t)std::strtol(name.c_str() + stagePrefix.size(), nullptr, 10);
+        if (pid > 0 && (::kill(pid, 0) == 0 || errno != ESRCH)) continue;
+        std::error_code rec;
+        fs::remove_all(it->path(), rec);
+    }
+}
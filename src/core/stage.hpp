@@ -0,0 +1,49 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include "archive.hpp"
+
+// A package extracted beside its destination, in a hidden directory inside
+// it (so always on the same filesystem), waiting to be switched in.
+//
+// activate() moves the staged paths over in archive order with renameat2:
+// a new directory is moved whole, an existing one is merged into, and an
+// existing file is swapped out (RENAME_EXCHANGE) so that a failure part
+// way can put everything back. A path whose directory in dest is a
+// symlink fails activation rather than being moved through it. Whatever
+// the stage still holds afterwards (replaced files, merged directories)
+// is removed with it.
+class Stage {
+public:
+    Stage(const std::string& dest, const std::string& name);
+    ~Stage();
+    Stage(const Stage&) = delete;
+    Stage& operator=(const Stage&) = delete;
+
+    const std::string& path() const { return dir; }
+    const std::string& error() const { return message; }
+    dev_t device() const { return dev; }
+
+    // one syncfs for the whole filesystem the stage is on
+    bool sync();
+    bool activate(const std::vector<Entry>& files);
+
+    // removes stages left by installs that are no longer running
+    static void cleanStale(const std::string& dest);
+
+private:
+    struct Move {
+        std::string path;
+        bool exchanged;
+    };
+
+    std::string dest;
+    std::string dir;
+    std::string message;
+    int destfd = -1;
+    int stagefd = -1;
+    dev_t dev = 0;
+
+    void rollback(const std::vector<Move>& done);
+};
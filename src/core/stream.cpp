@@ -0,0 +1,400 @@
+#include "stream.hpp"
+#include "package.hpp"
+#include "hash.hpp"
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <zlib.h>
+#ifdef PACMANOC_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cstdlib>
+
+FileSource::FileSource(const std::string& path) {
+    fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+FileSource::~FileSource() {
+    if (fd >= 0) ::close(fd);
+}
+
+size_t FileSource::read(char* out, size_t n) {
+    if (fd < 0) return 0;
+    ssize_t r;
+    do r = ::read(fd, out, n); while (r < 0 && errno == EINTR);
+    if (r < 0) {
+        err = true;
+        return 0;
+    }
+    return (size_t)r;
+}
+
+MappedSource::MappedSource(const std::string& path, bool hashing) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || ::fstat(fd, &st) != 0) {
+        if (fd >= 0) ::close(fd);
+        return;
+    }
+    len = (uint64_t)st.st_size;
+    if (len > 0) {
+        void* p = ::mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            map = (const char*)p;
+            // advice values are not flags; each takes a call of its own
+            ::madvise(p, len, MADV_SEQUENTIAL);
+            ::madvise(p, len, MADV_WILLNEED);
+        }
+    }
+    ::close(fd);
+    ok = len == 0 || map;
+    if (hashing) hash.reset(new Sha256);
+}
+
+MappedSource::~MappedSource() {
+    if (map) ::munmap((void*)map, len);
+}
+
+size_t MappedSource::read(char* out, size_t n) {
+    const char* p = view(n = (size_t)std::min<uint64_t>(n, len - pos));
+    if (p) memcpy(out, p, n);
+    return p ? n : 0;
+}
+
+const char* MappedSource::view(size_t n) {
+    if (!ok || n > len - pos) return nullptr;
+    const char* p = map + pos;
+    if (hash) hash->update(p, n);
+    pos += n;
+    return p;
+}
+
+std::string MappedSource::sha256() {
+    if (!ok || !hash) return "";
+    hash->update(map + pos, len - pos);
+    pos = len;
+    return hash->hex();
+}
+
+size_t JoinedSource::read(char* out, size_t n) {
+    if (!onSecond) {
+        size_t got = first.read(out, n);
+        if (got > 0 || first.failed()) return got;
+        onSecond = true;
+    }
+    return second.read(out, n);
+}
+
+Decoder::Decoder(Source& in, int threads) : in(in), threads(threads), buf(1 << 16) {}
+
+Decoder::~Decoder() {
+    if (zs) {
+        inflateEnd(zs);
+        delete zs;
+    }
+#ifdef PACMANOC_HAVE_ZSTD
+    ZSTD_freeDCtx(zstd);
+#endif
+}
+
+size_t Decoder::Rest::read(char* out, size_t n) {
+    if (d.pos == d.len) return d.in.read(out, n);
+    size_t got = std::min(n, d.len - d.pos);
+    memcpy(out, d.buf.data() + d.pos, got);
+    d.pos += got;
+    return got;
+}
+
+bool Decoder::refill() {
+    pos = 0;
+    len = in.read(buf.data(), buf.size());
+    return len > 0;
+}
+
+bool Decoder::sniff() {
+    // enough of the stream to tell the formats apart
+    while (len < 6) {
+        size_t r = in.read(buf.data() + len, buf.size() - len);
+        if (r == 0) break;
+        len += r;
+    }
+    const unsigned char* m = (const unsigned char*)buf.data();
+    if (len >= 2 && m[0] == 0x1f && m[1] == 0x8b) kind = "gzip";
+    else if (len >= 6 && memcmp(m, "\xfd" "7zXZ\0", 6) == 0) kind = "xz";
+    else if (len >= 3 && memcmp(m, "BZh", 3) == 0) kind = "bzip2";
+    else if (len >= 4 && memcmp(m, "\x28\xb5\x2f\xfd", 4) == 0) kind = "zstd";
+    else if (len >= 4 && memcmp(m, packageMagic, 4) == 0) kind = "ocpackage";
+    else kind = "tar";
+
+    if (kind == "gzip") {
+        zs = new z_stream{};
+        if (inflateInit2(zs, 15 + 16) != Z_OK) return false;
+    } else if (kind == "ocpackage") {
+        rest.reset(new Rest(*this));
+        frames.reset(new FrameDecoder(*rest, threads));
+    } else if (kind == "zstd") {
+#ifdef PACMANOC_HAVE_ZSTD
+        zstd = ZSTD_createDCtx();
+        return zstd != nullptr;
+#else
+        message = "pacmanoc was built without zstd support";
+        return false;
+#endif
+    } else if (kind != "tar") {
+        message = "unsupported archive compression: " + kind;
+        return false;
+    } else {
+        // nothing to undo and nothing gained by buffering
+        direct = in.view(0) != nullptr;
+    }
+    return true;
+}
+
+size_t Decoder::inflateZstd(char* out, size_t n) {
+#ifdef PACMANOC_HAVE_ZSTD
+    ZSTD_outBuffer o{out, n, 0};
+    while (o.pos == 0) {
+        if (pos == len && !refill()) {
+            // a clean end falls between frames
+            if (!end) err = true;
+            return 0;
+        }
+        ZSTD_inBuffer i{buf.data() + pos, len - pos, 0};
+        size_t ret = ZSTD_decompressStream(zstd, &o, &i);
+        pos += i.pos;
+        if (ZSTD_isError(ret)) {
+            message = std::string("zstd: ") + ZSTD_getErrorName(ret);
+            err = true;
+            return 0;
+        }
+        end = ret == 0;
+    }
+    return o.pos;
+#else
+    (void)out;
+    (void)n;
+    return 0;
+#endif
+}
+
+// An uncompressed tar over a source that can view() hands out that
+// source's bytes as they are, once whatever sniff() buffered is used up.
+const char* Decoder::view(size_t n) {
+    if (!direct || pos != len) return nullptr;
+    return in.view(n);
+}
+
+size_t Decoder::read(char* out, size_t n) {
+    // a zstd stream may go on with another frame after an end
+    if (err || (end && zs)) return 0;
+    if (kind.empty() && !sniff()) {
+        err = true;
+        return 0;
+    }
+
+    if (frames) {
+        size_t got = frames->read(out, n);
+        if (got == 0 && frames->failed()) {
+            message = frames->error();
+            err = true;
+        }
+        return got;
+    }
+    if (zstd) return inflateZstd(out, n);
+
+    if (!zs) {
+        if (pos == len && direct) return in.read(out, n);
+        if (pos == len && !refill()) return 0;
+        size_t got = std::min(n, len - pos);
+        memcpy(out, buf.data() + pos, got);
+        pos += got;
+        return got;
+    }
+
+    zs->next_out = (Bytef*)out;
+    zs->avail_out = (uInt)n;
+    while (zs->avail_out == n) {
+        if (pos == len) {
+            if (!refill()) {
+                err = true;     // stream ended inside the gzip member
+                return 0;
+            }
+        }
+        zs->next_in = (Bytef*)buf.data() + pos;
+        zs->avail_in = (uInt)(len - pos);
+        int ret = inflate(zs, Z_NO_FLUSH);
+        pos = len - zs->avail_in;
+        if (ret == Z_STREAM_END) {
+            end = true;
+            break;
+        }
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            err = true;
+            return 0;
+        }
+    }
+    return n - zs->avail_out;
+}
+
+// a chunk is flushed whenever the file reaches a multiple of it
+static const size_t sinkChunk = 1 << 20;
+static const size_t directAlign = 4096;
+
+FileSink::~FileSink() {
+    close();
+    free(buf);
+}
+
+bool FileSink::open(const std::string& path, bool append, uint64_t size, bool wantDirect) {
+    close();
+    err = false;
+    int flags = O_RDWR | O_CREAT | O_CLOEXEC | (append ? 0 : O_TRUNC);
+    file = ::open(path.c_str(), flags, 0644);
+    if (file < 0) return false;
+    struct stat st;
+    at = ::fstat(file, &st) == 0 ? (uint64_t)st.st_size : 0;
+    used = 0;
+    if (!buf && posix_memalign((void**)&buf, directAlign, sinkChunk) != 0) {
+        buf = nullptr;
+        close();
+        return false;
+    }
+    if (size > at)
+        ::fallocate(file, FALLOC_FL_KEEP_SIZE, 0, (off_t)size);
+    direct = wantDirect;
+    directOn = false;
+    return true;
+}
+
+bool FileSink::flush() {
+    if (used == 0 || err) return !err;
+    // O_DIRECT only for whole aligned blocks; some filesystems refuse it
+    bool aligned = at % directAlign == 0 && used % directAlign == 0;
+    if (direct && aligned != directOn) {
+        int fl = ::fcntl(file, F_GETFL);
+        if (::fcntl(file, F_SETFL, aligned ? fl | O_DIRECT : fl & ~O_DIRECT) == 0) directOn = aligned;
+        else if (aligned) direct = false;
+    }
+    for (size_t done = 0; done < used;) {
+        ssize_t w = ::pwrite(file, buf + done, used - done, (off_t)(at + done));
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && errno == EINVAL && directOn) {
+            direct = directOn = false;
+            ::fcntl(file, F_SETFL, ::fcntl(file, F_GETFL) & ~O_DIRECT);
+            continue;
+        }
+        if (w <= 0) {
+            err = true;
+            return false;
+        }
+        done += (size_t)w;
+    }
+    at += used;
+    used = 0;
+    return true;
+}
+
+bool FileSink::write(const char* data, size_t n) {
+    if (file < 0 || err) return false;
+    while (n > 0) {
+        size_t room = sinkChunk - (size_t)((at + used) % sinkChunk);
+        size_t take = std::min(n, room);
+        memcpy(buf + used, data, take);
+        used += take;
+        data += take;
+        n -= take;
+        if (take == room && !flush()) return false;
+    }
+    return true;
+}
+
+bool FileSink::close() {
+    if (file < 0) return !err;
+    flush();
+    // a shorter file than was reserved gives the rest back
+    ::ftruncate(file, (off_t)at);
+    if (::close(file) != 0) err = true;
+    file = -1;
+    return !err;
+}
+
+RingBuffer::RingBuffer(size_t capacity) : capacity(capacity) {}
+
+bool RingBuffer::tryWrite(const char* data, size_t n) {
+    std::lock_guard<std::mutex> lock(m);
+    if (stopped) return true;
+    if (buf.empty()) buf.resize(std::max(capacity, n));
+    if (n > buf.size() - used) {
+        if (n <= buf.size()) {
+            blocked = true;
+            return false;
+        }
+        // a chunk bigger than the whole buffer: grow rather than stall
+        std::vector<char> grown(used + n);
+        for (size_t i = 0; i < used; ++i) grown[i] = buf[(head + i) % buf.size()];
+        buf.swap(grown);
+        head = 0;
+    }
+
+    size_t tail = (head + used) % buf.size();
+    size_t first = std::min(n, buf.size() - tail);
+    memcpy(buf.data() + tail, data, first);
+    memcpy(buf.data(), data + first, n - first);
+    used += n;
+    cv.notify_one();
+    return true;
+}
+
+void RingBuffer::close(bool failed) {
+    std::lock_guard<std::mutex> lock(m);
+    closed = true;
+    broken = failed;
+    cv.notify_one();
+}
+
+bool RingBuffer::cancelled() {
+    std::lock_guard<std::mutex> lock(m);
+    return stopped;
+}
+
+size_t RingBuffer::read(char* out, size_t n) {
+    std::function<void()> wake;
+    size_t got;
+    {
+        std::unique_lock<std::mutex> lock(m);
+        cv.wait(lock, [this] { return used > 0 || closed; });
+        got = std::min(n, used);
+        size_t first = std::min(got, buf.size() - head);
+        memcpy(out, buf.data() + head, first);
+        memcpy(out + first, buf.data(), got - first);
+        head = used == got ? 0 : (head + got) % buf.size();
+        used -= got;
+        if (blocked && used <= buf.size() / 2) {
+            blocked = false;
+            wake = onSpace;
+        }
+    }
+    if (wake) wake();
+    return got;
+}
+
+void RingBuffer::cancel() {
+    std::function<void()> wake;
+    {
+        std::lock_guard<std::mutex> lock(m);
+        stopped = true;
+        used = 0;
+        if (blocked) wake = onSpace;
+    }
+    if (wake) wake();
+}
+
+bool RingBuffer::failed() {
+    std::lock_guard<std::mutex> lock(m);
+    return broken;
+}
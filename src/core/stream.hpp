@@ -0,0 +1,201 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+
+struct z_stream_s;
+struct ZSTD_DCtx_s;
+class FrameDecoder;
+class Sha256;
+
+// A forward-only byte stream. read returns 0 at the end, and also on an
+// error, which failed() then reports.
+//
+// view is read without the copy: it consumes the next n bytes and returns
+// where they sit, valid until the source is destroyed. Sources that cannot
+// do that (or have fewer than n bytes left) return nullptr and consume
+// nothing, and the caller falls back to read.
+class Source {
+public:
+    virtual ~Source() = default;
+    virtual size_t read(char* out, size_t n) = 0;
+    virtual bool failed() = 0;
+    virtual const char* view(size_t n) { (void)n; return nullptr; }
+};
+
+class FileSource : public Source {
+public:
+    explicit FileSource(const std::string& path);
+    ~FileSource();
+    FileSource(const FileSource&) = delete;
+    FileSource& operator=(const FileSource&) = delete;
+
+    size_t read(char* out, size_t n) override;
+    bool failed() override { return fd < 0 || err; }
+
+private:
+    int fd;
+    bool err = false;
+};
+
+// A whole file mapped read-only. With hashing on, sha256() is the digest
+// of the entire file, folded in as it is consumed, so checking an archive
+// costs no pass of its own.
+class MappedSource : public Source {
+public:
+    explicit MappedSource(const std::string& path, bool hash = false);
+    ~MappedSource();
+    MappedSource(const MappedSource&) = delete;
+    MappedSource& operator=(const MappedSource&) = delete;
+
+    size_t read(char* out, size_t n) override;
+    const char* view(size_t n) override;
+    bool failed() override { return !ok; }
+    uint64_t size() const { return len; }
+
+    // hashes whatever was not consumed and returns the digest of the file
+    std::string sha256();
+
+private:
+    const char* map = nullptr;
+    uint64_t len = 0;
+    uint64_t pos = 0;
+    bool ok = false;
+    std::unique_ptr<Sha256> hash;
+};
+
+// One source read to its end, then another: what an earlier run already
+// downloaded, followed by the rest as it arrives.
+class JoinedSource : public Source {
+public:
+    JoinedSource(Source& first, Source& second) : first(first), second(second) {}
+
+    size_t read(char* out, size_t n) override;
+    bool failed() override { return first.failed() || second.failed(); }
+
+private:
+    Source& first;
+    Source& second;
+    bool onSecond = false;
+};
+
+// Undoes an archive's compression, detected from its first bytes: gzip and
+// (when built with zstd) a plain zstd stream are inflated, an .ocpackage v2
+// goes through a FrameDecoder with `threads` frames in flight, and an
+// uncompressed tar passes through. Anything else fails; format() names what
+// was found and error() says why.
+class Decoder : public Source {
+public:
+    explicit Decoder(Source& in, int threads = 1);
+    ~Decoder();
+    Decoder(const Decoder&) = delete;
+    Decoder& operator=(const Decoder&) = delete;
+
+    size_t read(char* out, size_t n) override;
+    const char* view(size_t n) override;
+    bool failed() override { return err || in.failed(); }
+    const std::string& format() const { return kind; }
+    const std::string& error() const { return message; }
+
+private:
+    // the underlying stream, starting with the bytes sniff() buffered
+    class Rest : public Source {
+    public:
+        explicit Rest(Decoder& d) : d(d) {}
+        size_t read(char* out, size_t n) override;
+        bool failed() override { return d.in.failed(); }
+
+    private:
+        Decoder& d;
+    };
+
+    Source& in;
+    int threads;
+    std::vector<char> buf;
+    size_t pos = 0;
+    size_t len = 0;
+    std::string kind;
+    std::string message;
+    z_stream_s* zs = nullptr;
+    ZSTD_DCtx_s* zstd = nullptr;
+    std::unique_ptr<Rest> rest;
+    std::unique_ptr<FrameDecoder> frames;
+    bool err = false;
+    bool end = false;
+    bool direct = false;
+
+    bool sniff();
+    bool refill();
+    size_t inflateZstd(char* out, size_t n);
+};
+
+// An output file written in large, aligned chunks. When the final size is
+// known the space is reserved up front, in one extent where the filesystem
+// can, without changing the file's size, so a partial file still says how
+// much of it was written. With direct set the chunks bypass the page cache
+// (O_DIRECT) on filesystems that allow it; what is not aligned is written
+// the ordinary way.
+class FileSink {
+public:
+    FileSink() = default;
+    ~FileSink();
+    FileSink(const FileSink&) = delete;
+    FileSink& operator=(const FileSink&) = delete;
+
+    // appends to path, or truncates it first; readable through fd()
+    bool open(const std::string& path, bool append, uint64_t size = 0, bool direct = false);
+    bool write(const char* data, size_t n);
+    // flushes and closes; false if any write failed
+    bool close();
+
+    int fd() const { return file; }
+    uint64_t size() const { return at + used; }
+
+private:
+    int file = -1;
+    char* buf = nullptr;
+    size_t used = 0;
+    uint64_t at = 0;
+    bool direct = false;
+    bool directOn = false;
+    bool err = false;
+
+    bool flush();
+};
+
+// Bounded single-producer / single-consumer byte queue between a transfer
+// and whatever consumes the body. The producer side never blocks: a write
+// that does not fit is refused whole, and onSpace fires once the consumer
+// has drained enough for the producer to try again.
+class RingBuffer : public Source {
+public:
+    explicit RingBuffer(size_t capacity = 1 << 20);
+
+    // producer
+    bool tryWrite(const char* data, size_t n);
+    void close(bool failed = false);
+    bool cancelled();
+    std::function<void()> onSpace;
+
+    // consumer; read blocks until data arrives, returns 0 at the end
+    size_t read(char* out, size_t n) override;
+    void cancel();
+    bool failed() override;
+
+private:
+    std::mutex m;
+    std::condition_variable cv;
+    std::vector<char> buf;
+    size_t capacity;
+    size_t head = 0;
+    size_t used = 0;
+    bool closed = false;
+    bool broken = false;
+    bool stopped = false;
+    bool blocked = false;
+};
@@ -0,0 +1,186 @@
+#include "uring.hpp"
+#ifdef PACMANOC_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+Uring::Uring(unsigned want, unsigned files) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    fd = (int)::syscall(__NR_io_uring_setup, want, &p);
+    if (fd < 0) return;
+    // direct descriptors handed from an open to the write linked after it
+    if (!(p.features & IORING_FEAT_LINKED_FILE) || !probe()) {
+        shut();
+        return;
+    }
+    entries = p.sq_entries;
+
+    sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+    sqRing = ::mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED) {
+        sqRing = nullptr;
+        shut();
+        return;
+    }
+    if (single) {
+        cqRing = sqRing;
+    } else {
+        cqRing = ::mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) {
+            cqRing = nullptr;
+            shut();
+            return;
+        }
+    }
+    sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+    void* s = ::mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (s == MAP_FAILED) {
+        shut();
+        return;
+    }
+    sqes = (io_uring_sqe*)s;
+
+    char* sq = (char*)sqRing;
+    char* cq = (char*)cqRing;
+    sqHead = (unsigned*)(sq + p.sq_off.head);
+    sqTail = (unsigned*)(sq + p.sq_off.tail);
+    sqMask = (unsigned*)(sq + p.sq_off.ring_mask);
+    sqArray = (unsigned*)(sq + p.sq_off.array);
+    cqHead = (unsigned*)(cq + p.cq_off.head);
+    cqTail = (unsigned*)(cq + p.cq_off.tail);
+    cqMask = (unsigned*)(cq + p.cq_off.ring_mask);
+    cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+    tail = *sqTail;
+
+    // an empty table: opens fill the slots they are given
+    std::vector<int> table(files, -1);
+    if (files && ::syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES, table.data(), files) != 0)
+        shut();
+}
+
+Uring::~Uring() {
+    shut();
+}
+
+void Uring::shut() {
+    if (sqes) ::munmap(sqes, sqesSize);
+    if (cqRing && cqRing != sqRing) ::munmap(cqRing, cqRingSize);
+    if (sqRing) ::munmap(sqRing, sqRingSize);
+    sqes = nullptr;
+    sqRing = cqRing = nullptr;
+    if (fd >= 0) ::close(fd);
+    fd = -1;
+}
+
+bool Uring::probe() {
+    std::vector<char> buf(sizeof(io_uring_probe) + IORING_OP_LAST * sizeof(io_uring_probe_op), 0);
+    io_uring_probe* pr = (io_uring_probe*)buf.data();
+    if (::syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, pr, IORING_OP_LAST) != 0) return false;
+    for (int op : {IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_CLOSE, IORING_OP_UNLINKAT})
+        if (op > pr->last_op || !(pr->ops[op].flags & IO_URING_OP_SUPPORTED)) return false;
+    return true;
+}
+
+io_uring_sqe* Uring::next(uint64_t data, Chain chain) {
+    if (fd < 0 || tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= entries) return nullptr;
+    unsigned i = tail & *sqMask;
+    io_uring_sqe* s = &sqes[i];
+    memset(s, 0, sizeof(*s));
+    s->user_data = data;
+    s->flags = chain == Next ? IOSQE_IO_LINK : chain == Always ? IOSQE_IO_HARDLINK : 0;
+    sqArray[i] = i;
+    ++tail;
+    ++queued;
+    return s;
+}
+
+bool Uring::unlinkAt(int dirfd, const char* path, uint64_t data, Chain chain) {
+    io_uring_sqe* s = next(data, chain);
+    if (!s) return false;
+    s->opcode = IORING_OP_UNLINKAT;
+    s->fd = dirfd;
+    s->addr = (uint64_t)(uintptr_t)path;
+    return true;
+}
+
+bool Uring::openAt(int dirfd, const char* path, int flags, unsigned mode, unsigned slot, uint64_t data, Chain chain) {
+    io_uring_sqe* s = next(data, chain);
+    if (!s) return false;
+    s->opcode = IORING_OP_OPENAT;
+    s->fd = dirfd;
+    s->addr = (uint64_t)(uintptr_t)path;
+    s->open_flags = (uint32_t)flags;
+    s->len = mode;
+    s->file_index = slot + 1;
+    return true;
+}
+
+bool Uring::write(unsigned slot, const void* buf, unsigned len, uint64_t offset, uint64_t data, Chain chain) {
+    io_uring_sqe* s = next(data, chain);
+    if (!s) return false;
+    s->opcode = IORING_OP_WRITE;
+    s->flags |= IOSQE_FIXED_FILE;
+    s->fd = (int)slot;
+    s->addr = (uint64_t)(uintptr_t)buf;
+    s->len = len;
+    s->off = offset;
+    return true;
+}
+
+bool Uring::close(unsigned slot, uint64_t data, Chain chain) {
+    io_uring_sqe* s = next(data, chain);
+    if (!s) return false;
+    s->opcode = IORING_OP_CLOSE;
+    s->file_index = slot + 1;
+    return true;
+}
+
+bool Uring::run(const std::function<void(uint64_t data, int res)>& done) {
+    __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+    unsigned submitted = 0, completed = 0;
+    bool ok = true;
+    while (completed < submitted || (ok && submitted < queued)) {
+        unsigned toSubmit = ok ? queued - submitted : 0;
+        int r = (int)::syscall(__NR_io_uring_enter, fd, toSubmit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (r < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            // nothing more goes in; what already did is still waited for
+            ok = false;
+            if (completed == submitted) break;
+        }
+        if (r > 0) submitted += (unsigned)r;
+
+        unsigned head = *cqHead;
+        unsigned end = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; head != end; ++head, ++completed) {
+            const io_uring_cqe& c = cqes[head & *cqMask];
+            done(c.user_data, c.res);
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+    queued = 0;
+    return ok;
+}
+
+#else
+
+Uring::Uring(unsigned, unsigned) {}
+Uring::~Uring() {}
+void Uring::shut() {}
+bool Uring::probe() { return false; }
+io_uring_sqe* Uring::next(uint64_t, Chain) { return nullptr; }
+bool Uring::unlinkAt(int, const char*, uint64_t, Chain) { return false; }
+bool Uring::openAt(int, const char*, int, unsigned, unsigned, uint64_t, Chain) { return false; }
+bool Uring::write(unsigned, const void*, unsigned, uint64_t, uint64_t, Chain) { return false; }
+bool Uring::close(unsigned, uint64_t, Chain) { return false; }
+bool Uring::run(const std::function<void(uint64_t, int)>&) { return false; }
+
+#endif
@@ -0,0 +1,65 @@
+#pragma once
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// Just enough io_uring for the extractor, on the raw system calls: one
+// submission and one completion queue, a table of `files` direct
+// descriptors, and submit-then-wait. ok() is false when the kernel (or a
+// seccomp policy) does not offer io_uring, or lacks the ops the extractor
+// chains (openat, write, close, unlinkat); callers then use plain system
+// calls.
+class Uring {
+public:
+    Uring(unsigned entries, unsigned files);
+    ~Uring();
+    Uring(const Uring&) = delete;
+    Uring& operator=(const Uring&) = delete;
+
+    bool ok() const { return fd >= 0; }
+
+    // How an entry leads on to the one queued after it: Next runs that one
+    // only if this succeeded (otherwise it completes with -ECANCELED),
+    // Always runs it regardless.
+    enum Chain { End, Next, Always };
+
+    // each queues one entry, tagged with data, and returns false when the
+    // queue is full; files opened into a slot are used and closed by slot
+    bool unlinkAt(int dirfd, const char* path, uint64_t data, Chain chain);
+    bool openAt(int dirfd, const char* path, int flags, unsigned mode, unsigned slot, uint64_t data, Chain chain);
+    bool write(unsigned slot, const void* buf, unsigned len, uint64_t offset, uint64_t data, Chain chain);
+    bool close(unsigned slot, uint64_t data, Chain chain);
+
+    // submits everything queued and waits for all of it to complete,
+    // handing each completion's user_data and result to done
+    bool run(const std::function<void(uint64_t data, int res)>& done);
+
+private:
+    int fd = -1;
+    unsigned entries = 0;
+    unsigned tail = 0;
+    unsigned queued = 0;
+
+    void* sqRing = nullptr;
+    void* cqRing = nullptr;
+    size_t sqRingSize = 0;
+    size_t cqRingSize = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqesSize = 0;
+
+    unsigned* sqHead = nullptr;
+    unsigned* sqTail = nullptr;
+    unsigned* sqMask = nullptr;
+    unsigned* sqArray = nullptr;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned* cqMask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+
+    io_uring_sqe* next(uint64_t data, Chain chain);
+    bool probe();
+    void shut();
+};
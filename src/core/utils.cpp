@@ -1,8 +1,291 @@
 #include "utils.hpp"
 #include "manager.hpp"
-#include <cstdlib>
+#include "stream.hpp"
+#include "archive.hpp"
+#include "package.hpp"
+#include "db.hpp"
+#include <iostream>
+#include <iomanip>
+#include <filesystem>
+#include <cstring>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
-void PackageManager::extractPackage(const std::string& file, const std::string& dest) {
-    std::string cmd = "tar -xf " + file + " -C " + dest;
-    system(cmd.c_str());
+// Extracts in-process, through the object store when one is given and with
+// io_uring when asked for; reports what failed and returns false if
+// anything did.
+static bool extractFrom(Source& raw, const std::string& dest, int threads, const std::string& store, bool uring,
+                        std::vector<Entry>& files) {
+    Decoder in(raw, threads);
+    Extractor x(dest, uring ? 1 : threads);
+    if (!store.empty() && !x.setStore(store))
+        std::cerr << "[WARN] " << store << " is not on the same filesystem as " << dest << "; not using it\n";
+    if (uring && !x.setUring())
+        std::cerr << "[WARN] io_uring is not available; extracting with plain system calls\n";
+    bool ok = x.extract(in);
+
+    if (!in.error().empty())
+        std::cerr << "[ERROR] " << in.error() << "\n";
+    else if (!x.error().empty())
+        std::cerr << "[ERROR] " << x.error() << "\n";
+    int shown = 0;
+    for (auto& e : x.entries()) {
+        if (!e.error) continue;
+        if (++shown > 10) {
+            std::cerr << "[ERROR] ... and more\n";
+            break;
+        }
+        std::cerr << "[ERROR] " << dest << "/" << e.path << ": " << strerror(e.error) << "\n";
+    }
+    if (!store.empty() && ok)
+        std::cout << "\n[INFO] " << dest << ": " << (x.bytesWritten() >> 10) << " KiB written, "
+                  << (x.bytesReused() >> 10) << " KiB reused from the store\n";
+    files = x.entries();
+    return ok;
+}
+
+// The archive is mapped, so an uncompressed one is written out straight
+// from the page cache. With sha256 given (a cached archive) it is hashed
+// in the same pass and, if it does not match, dropped from the cache.
+bool PackageManager::extractPackage(const std::string& file, const std::string& dest, std::vector<Entry>& files,
+                                    const std::string& sha256) {
+    MappedSource in(file, !sha256.empty());
+    if (in.failed()) {
+        std::cerr << "[ERROR] cannot open " << file << "\n";
+        return false;
+    }
+    bool ok = extractFrom(in, dest, extractThreads, useStore ? storeDir : "", useUring, files);
+    if (!sha256.empty() && in.sha256() != sha256) {
+        std::cerr << "[ERROR] " << file << ": sha256 mismatch; removed it from the cache\n";
+        ::unlink(file.c_str());
+        return false;
+    }
+    return ok;
+}
+
+// Extracts an archive while it is still arriving, starting with the part
+// of it an earlier run downloaded, if there is one.
+bool PackageManager::extractStream(RingBuffer& in, Source* resumed, const std::string& dest,
+                                   std::vector<Entry>& files) {
+    std::unique_ptr<JoinedSource> joined;
+    if (resumed) joined = std::make_unique<JoinedSource>(*resumed, in);
+    Source& from = joined ? (Source&)*joined : in;
+    bool ok = extractFrom(from, dest, extractThreads, useStore ? storeDir : "", useUring, files);
+    if (!ok) {
+        in.cancel();
+        return false;
+    }
+    // whatever follows the archive still has to be taken off the transfer
+    char rest[4096];
+    while (in.read(rest, sizeof(rest)) > 0) {}
+    return !in.failed();
+}
+
+void PackageManager::pack(const std::string& dir, const std::string& out) {
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    PackageWriter w(out, frameSize, threads);
+    TarWriter tar([&w](const char* data, size_t n) { return w.write(data, n); });
+    if (!w.error().empty() || !tar.addTree(dir) || !tar.finish() || !w.finish(tar.entries())) {
+        std::cerr << "[ERROR] pack failed: " << (w.error().empty() ? tar.error() : w.error()) << "\n";
+        return;
+    }
+    std::cout << "[INFO] Packed " << dir << " into " << out << ": " << humanSize(w.rawBytes()) << " -> "
+              << humanSize(w.packedBytes()) << " in " << w.frames() << " frames\n";
+}
+
+std::string PackageManager::archiveURL(const std::string& name, const std::string& version) {
+    return baseURL + name + "/" + version + "/" + name + ".ocpackage";
+}
+
+// The version the index, or failing that latest.json, names as the newest;
+// "" when there is none or the entry is malformed, which is reported.
+std::string PackageManager::latestVersion(const std::string& name) {
+    std::string url = baseURL + name + "/latest.json";
+    const nlohmann::json* e = repoIndex().find(name);
+    nlohmann::json latest = e ? nlohmann::json() : getJSON(url);
+    if (!RepoIndex::wellFormed(e ? *e : latest)) {
+        std::cerr << "[ERROR] " << name << ": malformed " << (e ? "entry in the repository index" : url) << "\n";
+        return "";
+    }
+    return (e ? *e : latest).value("version", "");
+}
+
+// A local .ocpackage, or the latest version of a package in the repository.
+std::string PackageManager::locateArchive(const std::string& what) {
+    if (std::filesystem::is_regular_file(what)) return what;
+    std::string version = latestVersion(what);
+    if (version.empty()) return "";
+    std::string cached = archivePath(what, version);
+    return std::filesystem::is_regular_file(cached) ? cached : archiveURL(what, version);
+}
+
+// Reads len bytes at from, or with tail set the last len bytes, of a local
+// file or a remote archive (one ranged GET); total is the whole size.
+bool PackageManager::readRange(const std::string& where, uint64_t from, uint64_t len, bool tail,
+                               std::string& out, uint64_t& total) {
+    out.clear();
+    if (where.find("://") == std::string::npos) {
+        int fd = ::open(where.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || ::fstat(fd, &st) != 0) {
+            std::cerr << "[ERROR] " << where << ": " << strerror(errno) << "\n";
+            if (fd >= 0) ::close(fd);
+            return false;
+        }
+        total = st.st_size;
+        if (tail) {
+            len = std::min<uint64_t>(len, total);
+            from = total - len;
+        }
+        out.resize(from < total ? std::min<uint64_t>(len, total - from) : 0);
+        size_t got = 0;
+        while (got < out.size()) {
+            ssize_t r = ::pread(fd, &out[got], out.size() - got, from + got);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) break;
+            got += r;
+        }
+        ::close(fd);
+        return got == len;
+    }
+
+    Transfer t;
+    t.url = where;
+    t.range = tail ? "-" + std::to_string(len) : std::to_string(from) + "-" + std::to_string(from + len - 1);
+    bool ok = false;
+    t.done = [&](Transfer& r) {
+        if (!r.ok) {
+            std::cerr << "[ERROR] " << r.url << ": " << r.error << "\n";
+            return;
+        }
+        if (r.status == 206 && r.total >= 0) {
+            total = r.total;
+            out = std::move(r.body);
+        } else {
+            // the server sent the whole file; take our range out of it
+            total = r.body.size();
+            if (tail) from = total - std::min<uint64_t>(len, total);
+            out = from < total ? r.body.substr(from, len) : "";
+        }
+        ok = true;
+    };
+    fetch.add(std::move(t));
+    fetch.run();
+    return ok && (out.size() == len || (tail && out.size() == total));
+}
+
+bool PackageManager::loadFooter(const std::string& where, PackageFooter& footer) {
+    std::string tail, error;
+    uint64_t total = 0, need = 0;
+    if (!readRange(where, 0, PackageFooter::probe, true, tail, total)) return false;
+    if (!footer.parse(tail, total, need, error) && need > 0) {
+        // a big index: fetch exactly the rest of the footer
+        if (!readRange(where, 0, need, true, tail, total)) return false;
+        footer.parse(tail, total, need, error);
+    }
+    if (!error.empty()) {
+        std::cerr << "[ERROR] " << where << ": " << error << "\n";
+        return false;
+    }
+    if (!footer.indexed) {
+        std::cerr << "[ERROR] " << where << ": package has no file index\n";
+        return false;
+    }
+    return true;
+}
+
+static std::string modeString(const Entry& e) {
+    std::string s = e.type == '5' ? "d" : e.type == '2' ? "l" : e.type == '1' ? "h" : "-";
+    const char* rwx = "rwxrwxrwx";
+    for (int i = 0; i < 9; ++i) s += (e.mode & (0400 >> i)) ? rwx[i] : '-';
+    return s;
+}
+
+void PackageManager::showArchive(const std::string& what) {
+    std::string where = locateArchive(what);
+    PackageFooter footer;
+    if (where.empty()) {
+        std::cout << "Package '" << what << "' not found.\n";
+        return;
+    }
+    if (!loadFooter(where, footer)) return;
+
+    uint64_t bytes = 0;
+    for (auto& e : footer.files) bytes += e.size;
+    std::cout << "Archive: " << where << "\n";
+    std::cout << "Frames: " << footer.frames.size() << " x " << humanSize(footer.frameSize) << "\n";
+    std::cout << "Files: " << footer.files.size() << ", " << humanSize((double)bytes) << "\n";
+    for (auto& e : footer.files) {
+        std::cout << "  " << modeString(e) << " " << std::setw(10) << humanSize((double)e.size) << "  " << e.path;
+        if (!e.link.empty()) std::cout << (e.type == '2' ? " -> " : " => ") << e.link;
+        std::cout << "\n";
+    }
+}
+
+// Answered from the manifests in the database: no archive is fetched.
+void PackageManager::owner(const std::string& path) {
+    std::string abs = std::filesystem::absolute(path).lexically_normal().string();
+    Database& db = database();
+    for (auto& p : db.packages()) {
+        if (p.destination.empty()) continue;
+        std::string dest(p.destination);
+        while (!dest.empty() && dest.back() == '/') dest.pop_back();
+        dest += '/';
+        if (abs.size() <= dest.size() || abs.compare(0, dest.size(), dest) != 0) continue;
+        std::string rel = abs.substr(dest.size());
+
+        // installed before manifests: all that is known is the binary
+        bool owns = !p.manifest && rel == p.name;
+        if (p.manifest)
+            for (auto& f : db.files(p.name))
+                if ((owns = std::filesystem::path(f.path).lexically_normal() == rel)) break;
+        if (owns) {
+            std::cout << abs << " is owned by " << p.name << " " << p.version << "\n";
+            return;
+        }
+    }
+    std::cout << "No installed package owns " << abs << "\n";
+}
+
+void PackageManager::extractFile(const std::string& what, const std::string& path, const std::string& out) {
+    std::string where = locateArchive(what);
+    PackageFooter footer;
+    if (where.empty()) {
+        std::cout << "Package '" << what << "' not found.\n";
+        return;
+    }
+    if (!loadFooter(where, footer)) return;
+
+    const Entry* e = footer.find(path);
+    // a hardlink's body is stored with the file it points to
+    if (e && e->type == '1') e = footer.find(e->link);
+    if (!e) {
+        std::cerr << "[ERROR] " << path << " is not in " << where << "\n";
+        return;
+    }
+    if (e->type != '0') {
+        std::cerr << "[ERROR] " << path << " is not a regular file\n";
+        return;
+    }
+
+    uint64_t from, to, total;
+    std::string packed, data, error;
+    footer.span(*e, from, to);
+    if (to > from && !readRange(where, from, to - from, false, packed, total)) return;
+    if (!footer.body(*e, packed, data, error)) {
+        std::cerr << "[ERROR] " << path << ": " << error << "\n";
+        return;
+    }
+
+    std::string target = out.empty() ? std::filesystem::path(path).filename().string() : out;
+    int fd = ::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, e->mode & 07777);
+    bool ok = fd >= 0 && ::write(fd, data.data(), data.size()) == (ssize_t)data.size();
+    if (fd >= 0) ok = ::close(fd) == 0 && ok;
+    if (!ok) {
+        std::cerr << "[ERROR] " << target << ": " << strerror(errno) << "\n";
+        return;
+    }
+    std::cout << "[INFO] Extracted " << path << " (" << humanSize((double)data.size()) << ") to " << target << "\n";
 }
@@ -1,35 +1,83 @@
 #include "core/manager.hpp"
 #include <iostream>
+#include <vector>
+#include <cstdlib>
+#include <csignal>
 
 int main(int argc, char* argv[]) {
     if (argc < 2) {
-        std::cout << "Usage: pacmanoc [install|remove|show|ls|dir|autoremove|-s|-S|-v] <package>\n";
+        std::cout << "Usage: pacmanoc [-j N] [--segments N] [--extract-threads N] [--store] [--offline] [--direct-io] [--io-uring] [install|remove|show|ls|dir|autoremove|-s|-S|-v] <package>...\n"
+                  << "       pacmanoc [--frame-size MiB] pack <dir> <file.ocpackage>\n"
+                  << "       pacmanoc show --archive <package|file> | owns <path> | extract <package|file> <path> [out]\n"
+                  << "       pacmanoc db export --json\n";
         return 0;
     }
 
-    std::string cmd = argv[1];
+    // a connection closed under a write must fail that write, not end the process
+    std::signal(SIGPIPE, SIG_IGN);
+
     PackageManager mgr;
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        if ((a == "-j" || a == "--jobs") && i + 1 < argc)
+            mgr.setJobs(std::atoi(argv[++i]));
+        else if (a == "--segments" && i + 1 < argc)
+            mgr.setSegments(std::atoi(argv[++i]));
+        else if (a == "--extract-threads" && i + 1 < argc)
+            mgr.setExtractThreads(std::atoi(argv[++i]));
+        else if (a == "--store")
+            mgr.setStore(true);
+        else if (a == "--offline")
+            mgr.setOffline(true);
+        else if (a == "--direct-io")
+            mgr.setDirectIO(true);
+        else if (a == "--io-uring")
+            mgr.setUring(true);
+        else if (a == "--frame-size" && i + 1 < argc)
+            mgr.setFrameSize(std::atoi(argv[++i]));
+        else
+            args.push_back(a);
+    }
+    if (args.empty()) {
+        std::cout << "Unknown command.\n";
+        return 0;
+    }
+
+    std::string cmd = args[0];
+    size_t argn = args.size();
 
-    if (cmd == "install" && argc > 2)
-        mgr.install(argv[2]);
-    else if ((cmd == "remove" || cmd == "uninstall") && argc > 2)
-        mgr.remove(argv[2]);
-    else if (cmd == "show" && argc > 2)
-        mgr.show(argv[2]);
+    if (cmd == "install" && argn > 1)
+        mgr.install(std::vector<std::string>(args.begin() + 1, args.end()));
+    else if (cmd == "show" && argn > 2 && args[1] == "--archive")
+        mgr.showArchive(args[2]);
+    else if (cmd == "owns" && argn > 1)
+        mgr.owner(args[1]);
+    else if (cmd == "extract" && argn > 2)
+        mgr.extractFile(args[1], args[2], argn > 3 ? args[3] : "");
+    else if ((cmd == "remove" || cmd == "uninstall") && argn > 1)
+        mgr.remove(args[1]);
+    else if (cmd == "show" && argn > 1)
+        mgr.show(args[1]);
     else if (cmd == "ls" || cmd == "list")
         mgr.list();
     else if (cmd == "dir")
         mgr.dir();
     else if (cmd == "autoremove")
         mgr.autoremove();
-    else if (cmd == "-s" && argc > 2)
-        mgr.sync(argv[2]);
+    else if (cmd == "-s" && argn > 1)
+        mgr.sync(args[1]);
     else if (cmd == "-S")
         mgr.syncAll();
+    else if (cmd == "db" && argn > 2 && args[1] == "export" && args[2] == "--json")
+        mgr.exportDatabase();
+    else if (cmd == "pack" && argn > 2)
+        mgr.pack(args[1], args[2]);
     else if (cmd == "-v" || cmd == "version")
         mgr.showVersion();
     else
         std::cout << "Unknown command.\n";
 
+    mgr.commit();
     return 0;
 }
@@ -0,0 +1,92 @@
+// Packs a small tree with TarWriter and extracts it again with Extractor,
+// serially and through the worker pool, checking that links survive as
+// links: a symlink inside the tree, a hardlink, and symlinks that point
+// outside it, which must be written as symlinks and never followed.
+#include "core/archive.hpp"
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace fs = std::filesystem;
+
+static int failures = 0;
+
+static void check(bool ok, const std::string& what) {
+    if (ok) return;
+    std::cerr << "FAIL: " << what << "\n";
+    ++failures;
+}
+
+static std::string readFile(const fs::path& p) {
+    std::ifstream f(p, std::ios::binary);
+    std::ostringstream ss;
+    ss << f.rdbuf();
+    return ss.str();
+}
+
+static std::string linkTarget(const fs::path& p) {
+    std::error_code ec;
+    return fs::is_symlink(fs::symlink_status(p, ec)) ? fs::read_symlink(p, ec).string() : "";
+}
+
+int main() {
+    fs::path work = fs::temp_directory_path() / ("pacmanoc-roundtrip." + std::to_string(::getpid()));
+    fs::remove_all(work);
+    fs::path tree = work / "tree";
+    fs::path outside = work / "outside.txt";
+    fs::create_directories(tree / "bin");
+    fs::create_directories(tree / "sub");
+    std::ofstream(tree / "a.txt") << "hello\n";
+    std::ofstream(tree / "sub" / "b.txt") << "nested\n";
+    std::ofstream(outside) << "not packaged\n";
+    fs::create_hard_link(tree / "a.txt", tree / "hard");
+    fs::create_symlink("a.txt", tree / "link");
+    fs::create_symlink(outside, tree / "bin" / "ext");
+    fs::create_symlink("../../outside.txt", tree / "sub" / "up");
+
+    std::string tar = (work / "tree.tar").string();
+    {
+        FILE* f = fopen(tar.c_str(), "wb");
+        TarWriter w([f](const char* data, size_t n) { return fwrite(data, 1, n, f) == n; });
+        bool ok = w.addTree(tree.string()) && w.finish();
+        fclose(f);
+        check(ok, "pack: " + w.error());
+        for (auto& e : w.entries()) {
+            check(e.path.find("..") == std::string::npos, "member outside the tree: " + e.path);
+            if (e.path == "link" || e.path == "bin/ext" || e.path == "sub/up")
+                check(e.type == '2', e.path + " packed as type " + std::string(1, e.type));
+            if (e.type == '1') check(e.link != e.path, e.path + " is a hardlink to itself");
+        }
+    }
+
+    for (int threads : {1, 4}) {
+        std::string mode = threads == 1 ? "serial: " : "pool: ";
+        fs::path dest = work / ("dest" + std::to_string(threads));
+        {
+            FileSource in(tar);
+            Extractor x(dest.string(), threads);
+            check(x.extract(in), mode + "extract: " + x.error());
+            for (auto& e : x.entries()) check(e.error == 0, mode + e.path + ": " + strerror(e.error));
+        }
+        check(readFile(dest / "a.txt") == "hello\n", mode + "a.txt");
+        check(readFile(dest / "sub" / "b.txt") == "nested\n", mode + "sub/b.txt");
+        struct stat a, h;
+        check(::lstat((dest / "a.txt").c_str(), &a) == 0 && ::lstat((dest / "hard").c_str(), &h) == 0
+              && a.st_ino == h.st_ino, mode + "hard is not a hardlink of a.txt");
+        check(linkTarget(dest / "link") == "a.txt", mode + "link");
+        check(linkTarget(dest / "bin" / "ext") == outside.string(), mode + "bin/ext");
+        check(linkTarget(dest / "sub" / "up") == "../../outside.txt", mode + "sub/up");
+    }
+    check(readFile(outside) == "not packaged\n", "outside.txt was changed");
+
+    fs::remove_all(work);
+    if (failures) return 1;
+    std::cout << "pack round trip ok\n";
+    return 0;
+}